@@ -1,6 +1,24 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
 #include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <ucontext.h>
+#include <signal.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <editline/readline.h>
 
@@ -10,7 +28,8 @@
   if (!(cond)) { lval_del(args); return lval_err(err); }
 
 
-enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR };
+enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_SEQ, LVAL_FUTURE, LVAL_CHAN, LVAL_ACTOR,
+       LVAL_HMAP };
 
 enum { LVAL_LONG, LVAL_DOUBLE};
 
@@ -20,19 +39,580 @@ union Number {
     double double_num;
 };
 
+struct chunk;
+struct lval;
+struct lenv;
+struct lscope;
+struct lproto;
+struct lseq;
+struct lfuture;
+struct lchan;
+struct lactor;
+struct lhmap;
+
+typedef struct lval* (*lbuiltin)(struct lenv*, struct lval*);
+
 typedef struct lval {
     int type;
     int num_type;
     union Number* num;
 
-    /* Error and Symbol types have some string data */
+    /* Error and Symbol types have some string data, symbols are interned */
     char* err;
     char* sym;
+
+    /* Symbol naming a local variable: frames up from the current one and
+       slot in that frame. Globals have depth -1 */
+    int depth;
+    int slot;
+
+    /* Function is a builtin or a lambda closed over the frame it was made in,
+       or a memoized function: a builtin calling another through a cache */
+    lbuiltin builtin;
+    struct lproto* proto;
+    struct lenv* env;
+    struct lmemo* memo;
     /* Count and Pointer to a list of "lval*" */
     int count;
     struct lval** cell;
+
+    /* Lazy sequence, shared by copies */
+    struct lseq* seq;
+
+    /* Evaluation under way on the thread pool or in a green thread,
+       channel between green threads, actor and hash map, shared by copies */
+    struct lfuture* future;
+    struct lchan* chan;
+    struct lactor* actor;
+    struct lhmap* hmap;
+
+    /* Bytecode compiled from a Q-expression by "eval", and the lambda of
+       a (\ ...) S-expression, shared by copies */
+    struct chunk* code;
+
+    /* Size of an S-expression for parallel evaluation, 0 until worked
+       out and -1 when it can't be evaluated on another thread */
+    int weight;
+
+    /* Hash of a list's elements, 0 until worked out and copied with it */
+    unsigned long hash;
 } lval;
 
+/* Value on the VM stack, numbers are kept unboxed */
+enum { VV_LONG, VV_DOUBLE, VV_LVAL };
+
+typedef struct vval {
+    int tag;
+    union {
+        long l;
+        double d;
+        lval* v;
+    };
+} vval;
+
+/* Native code for a chunk run in frame "env", answers 0 and the result
+   or 1 to bail out */
+typedef int (*jit_fn)(vval* out, struct lenv* env);
+
+/* Inline cache of a call site, remembering what the called global was
+   when it was last looked up. It holds while no global is (re)defined */
+typedef struct icache {
+    long version;
+
+    /* The function, still owned by the table, and the code of its body
+       when it is a lambda taking as many arguments as the site passes */
+    struct lval* f;
+    struct chunk* code;
+} icache;
+
+/* Compiled bytecode with its constant pool */
+typedef struct chunk {
+    int* code;
+    int count;
+    int cap;
+
+    vval* consts;
+    int nconsts;
+
+    icache* caches;
+    int ncaches;
+
+    /* Stack slots needed to run the chunk, above its temporaries */
+    int max_stack;
+    int ntemps;
+    int refs;
+
+    /* Quickened instructions that had to be turned back */
+    int deopts;
+
+    /* Runs so far, until compiled to native code (-1 once it is, or when
+       it can't be), and the times the native code bailed out */
+    int hot;
+    jit_fn jit;
+    size_t jit_size;
+    int jit_bails;
+
+    /* Scope the code was compiled for, NULL at top level */
+    struct lscope* scope;
+} chunk;
+
+void chunk_release(chunk* c);
+void jit_free(chunk* c);
+void lscope_release(struct lscope* s);
+void lproto_release(struct lproto* p);
+void lenv_release(struct lenv* e);
+void lseq_release(struct lseq* s);
+void lfuture_release(struct lfuture* f);
+void lchan_release(struct lchan* c);
+void lactor_release(struct lactor* a);
+void lmemo_release(struct lmemo* m);
+void lhmap_release(struct lhmap* m);
+
+/* Names of the variables of a lambda or let, inside the scope of the
+   lambda the code was written in */
+typedef struct lscope {
+    int refs;
+    int count;
+    char** names;
+    struct lscope* parent;
+
+    /* Variables of the scopes around it that the code uses. A lambda
+       copies them when it is made, so they are fixed once it exists */
+    int ncaptures;
+    char** captures;
+    int fixed;
+} lscope;
+
+/* Formals and body of a lambda, shared by every copy of it */
+typedef struct lproto {
+    int refs;
+    lscope* scope;
+
+    /* Captured variables, as resolved in the code making the lambda */
+    lval* from;
+    lscope* captures;
+
+    /* Resolved body, evaluated by each call, and compiled on the first */
+    lval* body;
+    chunk* code;
+} lproto;
+
+/* Lazy sequence. A range counts from "start" up to "end" by "step". An
+   iterate sequence is x, (f x), (f (f x)) and so on. A generate sequence
+   calls f on a state for {value next-state}, and ends when it gives {}.
+   Both start "skip" steps past "x". A list sequence views the list "x"
+   from index "start". Map and filter sequences are stages over the
+   sequence "src", run one value at a time. Sequences never change once
+   made */
+enum { SEQ_RANGE, SEQ_ITERATE, SEQ_GENERATE, SEQ_LIST, SEQ_MAP, SEQ_FILTER };
+
+typedef struct lseq {
+    int refs;
+    int kind;
+    long start;
+    long end;
+    long step;
+    struct lval* f;
+    struct lval* x;
+    long skip;
+    struct lval* src;
+} lseq;
+
+/* Flat frame of variables: a call's arguments, with "parent" holding the
+   variables its lambda captured, or those captured variables themselves */
+typedef struct lenv {
+    int refs;
+    struct lenv* parent;
+    lscope* scope;
+    vval slots[];
+} lenv;
+
+
+/* Set once other threads are running, from then on reference counts
+   change atomically */
+int threaded = 0;
+
+void ref_inc(int* refs) {
+    if (threaded) { __atomic_add_fetch(refs, 1, __ATOMIC_RELAXED); } else { (*refs)++; }
+}
+
+/* Drop a reference, giving how many are left */
+int ref_dec(int* refs) {
+    return threaded ? __atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL) : --*refs;
+}
+
+/* Set while the running thread runs a task of the pool. Such code may not
+   define globals */
+_Thread_local int in_task = 0;
+
+/* Fuel: steps the running evaluation may still take. A step is starting
+   an expression on the tree walker, a chunk or a call on the VM, or a
+   value of a sequence. Running out is an error. Tasks, futures and
+   actors take their steps from the fuel of where they are made, so all
+   of them together take no more than it has.
+
+   The fuel is handed out a slice at a time: "fuel_left" counts down the
+   steps of the slice, "fuel_pool" holds the rest, shared by all that
+   run on it, NULL for no limit. Getting the next slice is where
+   evaluation also stops for Ctrl+C or a timeout, so the one check on
+   each step covers all three */
+#define FUEL_SLICE 1024
+
+typedef struct lfuel {
+    long left;
+    int refs;
+} lfuel;
+
+_Thread_local long fuel_left = FUEL_SLICE;
+_Thread_local lfuel* fuel_pool = NULL;
+
+/* When the running evaluation times out, 0 for never */
+_Thread_local double fuel_deadline = 0;
+
+/* Set by Ctrl+C, stops whatever is being evaluated */
+atomic_int eval_interrupted;
+
+/* Fuel for each input, 0 for no limit */
+long fuel_limit = 0;
+
+double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Fuel of "n" steps, NULL for LONG_MAX, no limit */
+lfuel* lfuel_new(long n) {
+    if (n == LONG_MAX) { return NULL; }
+    lfuel* f = malloc(sizeof(lfuel));
+    f->left = n;
+    f->refs = 1;
+    return f;
+}
+
+lfuel* lfuel_copy(lfuel* f) {
+    if (f) { ref_inc(&f->refs); }
+    return f;
+}
+
+void lfuel_release(lfuel* f) {
+    if (f && ref_dec(&f->refs) == 0) { free(f); }
+}
+
+/* Fuel left in all */
+long fuel_total(void) {
+    if (!fuel_pool) { return LONG_MAX; }
+    long n = __atomic_load_n(&fuel_pool->left, __ATOMIC_RELAXED) + (fuel_left < 0 ? 0 : fuel_left);
+    return n < 0 ? 0 : n;
+}
+
+/* Run on fuel "f" from here on, giving back what is left of the slice
+   taken from the fuel run on so far, which is returned */
+lfuel* fuel_use(lfuel* f) {
+    lfuel* prev = fuel_pool;
+    if (prev && fuel_left > 0) { __atomic_add_fetch(&prev->left, fuel_left, __ATOMIC_RELAXED); }
+    fuel_pool = f;
+    fuel_left = 0;
+    return prev;
+}
+
+/* Take the next slice, 0 when the fuel is used up */
+long fuel_take(void) {
+    if (!fuel_pool) { return FUEL_SLICE; }
+    long n = __atomic_load_n(&fuel_pool->left, __ATOMIC_RELAXED);
+    long slice;
+    do {
+        if (n <= 0) { return 0; }
+        slice = n < FUEL_SLICE ? n : FUEL_SLICE;
+    } while (!__atomic_compare_exchange_n(&fuel_pool->left, &n, n - slice, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return slice;
+}
+
+void fuel_refill(void) {
+    lfuel_release(fuel_use(lfuel_new(fuel_limit ? fuel_limit : LONG_MAX)));
+    fuel_deadline = 0;
+}
+
+struct lval* eval_stopped(void);
+struct lval* fuel_out(void);
+
+/* Memory of values. Values, the numbers and strings they hold and the
+   arrays of list elements are allocated here, which counts the bytes
+   live. An input holding "mem_quota" bytes more than were live when it
+   started is stopped at the next step, as if out of fuel */
+long mem_live = 0;
+
+/* Most live at once since the running input started, and live then */
+long mem_peak = 0;
+long mem_base = 0;
+
+/* Bytes each input may hold, 0 for no limit */
+long mem_quota = 0;
+
+/* Set once the running input is over its quota */
+atomic_int mem_exceeded;
+
+/* Count "n" more bytes live. Once threads run, the peak is only noted
+   by mem_check */
+void mem_count(long n) {
+    if (threaded) {
+        __atomic_add_fetch(&mem_live, n, __ATOMIC_RELAXED);
+    } else if ((mem_live += n) > mem_peak) {
+        mem_peak = mem_live;
+    }
+}
+
+/* Note the peak and see whether the input is over its quota. Done when
+   a list grows past a multiple of 64 elements and when a slice of fuel
+   runs out, for the plain values of an input don't take much room
+   without lists holding them */
+void mem_check(void) {
+    long live = __atomic_load_n(&mem_live, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&mem_peak, &peak, live, 1,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+    if (mem_quota && live - __atomic_load_n(&mem_base, __ATOMIC_RELAXED) > mem_quota) {
+        atomic_store(&mem_exceeded, 1);
+        fuel_left = 0;
+    }
+}
+
+void* mem_alloc(size_t n) {
+    mem_count(n);
+    return malloc(n);
+}
+
+void mem_free(void* p, size_t n) {
+    mem_count(-(long)n);
+    free(p);
+}
+
+/* Resize the array of list elements "cell" to "n" elements, NULL for
+   none. The array keeps its size just in front of it, so that it is
+   counted right whatever count it is freed at */
+struct lval** cells_resize(struct lval** cell, int n) {
+    size_t* h = cell ? (size_t*)cell - 2 : NULL;
+    long old = h ? (long)h[0] : 0;
+    if (n == 0) {
+        free(h);
+        mem_count(-old);
+        return NULL;
+    }
+    h = realloc(h, sizeof(size_t) * 2 + sizeof(struct lval*) * n);
+    h[0] = sizeof(struct lval*) * n;
+    mem_count((long)h[0] - old);
+    if (n / 64 > old / (long)sizeof(struct lval*) / 64) { mem_check(); }
+    return (struct lval**)(h + 2);
+}
+
+void cells_free(struct lval** cell) { cells_resize(cell, 0); }
+
+/* Start counting for a new input */
+void mem_start(void) {
+    atomic_store(&mem_exceeded, 0);
+    __atomic_store_n(&mem_base, __atomic_load_n(&mem_live, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&mem_peak, __atomic_load_n(&mem_live, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+/* Green threads waiting in turn, to run or on a channel or future */
+typedef struct gqueue {
+    struct gthread* head;
+    struct gthread* tail;
+} gqueue;
+
+/* Expression evaluated by a task of the pool, or by a green thread, in
+   frame "e". Shared by copies and by the task, which sets "result" and
+   then "ready" */
+typedef struct lfuture {
+    int refs;
+    struct lval* code;
+    lenv* e;
+    struct lval* result;
+    atomic_int ready;
+    int green;
+    gqueue waiters;
+} lfuture;
+
+/* Channel of green threads holding up to "cap" values, with the threads
+   waiting to put a value in and to take one out. A sender waiting holds
+   its value until a receiver takes it, so (chan 0) hands values straight
+   from sender to receiver */
+typedef struct lchan {
+    int refs;
+    lval** buf;
+    int cap;
+    int head;
+    int count;
+    gqueue senders;
+    gqueue receivers;
+} lchan;
+
+/* Message in an actor's mailbox */
+typedef struct mnode {
+    struct mnode* _Atomic next;
+    struct lval* v;
+} mnode;
+
+/* Actor: code running on a thread of its own, taking messages from its
+   mailbox. The mailbox is a lock-free queue with any number of senders
+   and the actor as the only receiver. Senders swap themselves in at
+   "tail", the actor takes from "head", which is always a node already
+   taken. The actor sleeps on "wake" once it has set "waiting" */
+typedef struct lactor {
+    int refs;
+    mnode* _Atomic tail;
+    mnode* head;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    atomic_int waiting;
+
+    /* Function the actor runs and the future for its value, NULL for the
+       main code */
+    struct lval* fn;
+    struct lval* future;
+
+    /* Fuel the actor runs on, that of its maker, and when it times out */
+    lfuel* fuel;
+    double deadline;
+} lactor;
+
+/* Cache of a memoized function, shared by copies. Entries are kept in
+   buckets by the hash of their arguments, and in order of use */
+typedef struct mentry {
+    unsigned long hash;
+    lval* args;
+    lval* value;
+    long bytes;
+
+    /* Next in the bucket, and the neighbours by time of use */
+    struct mentry* next;
+    struct mentry* newer;
+    struct mentry* older;
+} mentry;
+
+typedef struct lmemo {
+    int refs;
+    lval* fn;
+    pthread_mutex_t lock;
+
+    mentry** buckets;
+    long nbuckets;
+    long count;
+    mentry* newest;
+    mentry* oldest;
+
+    long bytes;
+    long max_bytes;
+    long hits;
+    long misses;
+} lmemo;
+
+/* Hash map, changed in place and shared by copies. It is a Swiss table:
+   open addressing with a control byte for each slot, holding the low 7
+   bits of the hash of the key in it or marking it empty or deleted. A
+   lookup scans the control bytes a group of 16 at a time for those bits
+   and only compares keys where they match. The first group of control
+   bytes is repeated after the last, so a group can start at any slot.
+   Keys and values are kept as on the VM stack, numbers unboxed */
+typedef struct hslot {
+    unsigned long hash;
+    vval key;
+    vval value;
+} hslot;
+
+typedef struct lhmap {
+    int refs;
+    pthread_mutex_t lock;
+    signed char* ctrl;
+    hslot* slots;
+    long cap;
+    long count;
+    long deleted;
+} lhmap;
+
+/* Actor the running thread is, NULL in tasks of the pool */
+_Thread_local lactor* actor_self = NULL;
+
+unsigned long hash_mix(unsigned long h, unsigned long x) {
+    h ^= x + 0x9e3779b97f4a7c15UL + (h << 6) + (h >> 2);
+    return h;
+}
+
+unsigned long hash_str(char* s) {
+    unsigned long h = 1469598103934665603UL;
+    for (; *s; s++) { h = (h ^ (unsigned char)*s) * 1099511628211UL; }
+    return h;
+}
+
+unsigned long hash_ptr(void* p) {
+    unsigned long h = (unsigned long)p;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Interned symbol names. Every symbol with the same name points to the
+   same string, so names compare by address and are never freed */
+typedef struct sym_table {
+    char** slots;
+    int cap;
+    int count;
+} sym_table;
+
+sym_table symbols = { NULL, 0, 0 };
+pthread_mutex_t sym_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char* intern_locked(char* s) {
+    unsigned long h = hash_str(s);
+    if (symbols.cap) {
+        for (int i = h & (symbols.cap - 1); symbols.slots[i]; i = (i + 1) & (symbols.cap - 1)) {
+            if (strcmp(symbols.slots[i], s) == 0) { return symbols.slots[i]; }
+        }
+    }
+
+    /* Keep the table at most half full */
+    if (2 * (symbols.count + 1) > symbols.cap) {
+        int cap = symbols.cap ? symbols.cap * 2 : 256;
+        char** slots = calloc(cap, sizeof(char*));
+        for (int i = 0; i < symbols.cap; i++) {
+            if (!symbols.slots[i]) { continue; }
+            int j = hash_str(symbols.slots[i]) & (cap - 1);
+            while (slots[j]) { j = (j + 1) & (cap - 1); }
+            slots[j] = symbols.slots[i];
+        }
+        free(symbols.slots);
+        symbols.slots = slots;
+        symbols.cap = cap;
+    }
+
+    int i = h & (symbols.cap - 1);
+    while (symbols.slots[i]) { i = (i + 1) & (symbols.cap - 1); }
+    symbols.slots[i] = malloc(strlen(s) + 1);
+    strcpy(symbols.slots[i], s);
+    symbols.count++;
+    return symbols.slots[i];
+}
+
+/* Threads parsing code take turns with the table */
+char* intern(char* s) {
+    if (!threaded) { return intern_locked(s); }
+    pthread_mutex_lock(&sym_lock);
+    char* r = intern_locked(s);
+    pthread_mutex_unlock(&sym_lock);
+    return r;
+}
+
+/* Names the evaluator and compiler look for, set up by lenv_add_builtins */
+char* sym_eval;
+char* sym_lambda;
+char* sym_let;
+char* sym_cond;
+char* sym_if;
+char* sym_and;
+char* sym_or;
+
 
 lval* set_long_num(lval* v, long x) {
     v->num->long_num = x;
@@ -49,55 +629,116 @@ lval* set_double_num(lval* v, double x) {
 
 /* Construct a pointer to a new Number lval */
 lval* lval_long_num(long x) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = mem_alloc(sizeof(lval));
     v->type = LVAL_NUM;
-    v->num = malloc(sizeof(union Number));
+    v->num = mem_alloc(sizeof(union Number));
     return set_long_num(v, x);
 
 }
 
 /* Construct a pointer to a new Number lval */
 lval* lval_double_num(double x) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = mem_alloc(sizeof(lval));
     v->type = LVAL_NUM;
-    v->num = malloc(sizeof(union Number));
+    v->num = mem_alloc(sizeof(union Number));
     return set_double_num(v, x);
 }
 
 
 /* Construct a pointer to a new Error lval */
-lval* lval_err(char* m) {
-    lval* v = malloc(sizeof(lval));
+lval* lval_err(char* fmt, ...) {
+    lval* v = mem_alloc(sizeof(lval));
     v->type = LVAL_ERR;
-    v->err = malloc(strlen(m) + 1);
-    strcpy(v->err, m);
+
+    va_list va;
+    va_start(va, fmt);
+    char buf[512];
+    vsnprintf(buf, 512, fmt, va);
+    v->err = mem_alloc(strlen(buf) + 1);
+    strcpy(v->err, buf);
+    va_end(va);
     return v;
 }
 
-/* Construct a pointer to a new Symbol lval */
+/* The error to stop with for Ctrl+C, a timeout or the memory quota,
+   else NULL */
+lval* eval_stopped(void) {
+    if (atomic_load(&eval_interrupted)) { return lval_err("Evaluation interrupted!"); }
+    if (atomic_load(&mem_exceeded)) { return lval_err("Evaluation ran out of memory!"); }
+    if (fuel_deadline && now_ns() > fuel_deadline) { return lval_err("Evaluation timed out!"); }
+    return NULL;
+}
+
+/* Called on a step once the slice is used up. Gives the next slice and
+   NULL to go on, or the error evaluation stops with */
+lval* fuel_out(void) {
+    fuel_left = 0;
+    mem_check();
+    lval* err = eval_stopped();
+    if (err) { return err; }
+    long slice = fuel_take();
+    if (slice == 0) { return lval_err("Evaluation ran out of fuel!"); }
+    fuel_left = slice - 1;
+    return NULL;
+}
+
+/* Construct a pointer to a new Symbol lval, unresolved until a lambda
+   claims it */
 lval* lval_sym(char* s) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = mem_alloc(sizeof(lval));
     v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
+    v->sym = intern(s);
+    v->depth = -1;
+    v->slot = 0;
+    return v;
+}
+
+lval* lval_builtin(lbuiltin func) {
+    lval* v = mem_alloc(sizeof(lval));
+    v->type = LVAL_FUN;
+    v->builtin = func;
+    v->proto = NULL;
+    v->env = NULL;
+    v->memo = NULL;
     return v;
 }
 
+/* A new sequence of "kind", its fields left for the caller to fill in */
+lval* lval_seq(int kind) {
+    lseq* s = malloc(sizeof(lseq));
+    s->refs = 1;
+    s->kind = kind;
+    s->start = s->end = s->step = s->skip = 0;
+    s->f = s->x = s->src = NULL;
+
+    lval* v = mem_alloc(sizeof(lval));
+    v->type = LVAL_SEQ;
+    v->seq = s;
+    return v;
+}
 
 /* A pointer to a new empty Sexpr lval */
 lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = mem_alloc(sizeof(lval));
     v->type = LVAL_SEXPR;
     v->count = 0;
     v->cell = NULL;
+    v->code = NULL;
+    v->weight = 0;
+    v->hash = 0;
+    v->proto = NULL;
     return v;
 }
 
 lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = mem_alloc(sizeof(lval));
     v->type = LVAL_QEXPR;
     v->count = 0;
     v->cell = NULL;
+    v->code = NULL;
+    v->weight = 0;
+    v->hash = 0;
+    v->proto = NULL;
     return v;
 }
 
@@ -113,9 +754,24 @@ lval* lval_read_num(mpc_ast_t* t) {
     }
 }
 
+/* Compiled code no longer matches a list that is being changed */
+void lval_uncache(lval* v) {
+    v->weight = 0;
+    v->hash = 0;
+    if (v->code) {
+        chunk_release(v->code);
+        v->code = NULL;
+    }
+    if (v->proto) {
+        lproto_release(v->proto);
+        v->proto = NULL;
+    }
+}
+
 lval* lval_add(lval* v, lval* x) {
+    lval_uncache(v);
     v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    v->cell = cells_resize(v->cell, v->count);
     v->cell[v->count-1] = x;
     return v;
 }
@@ -149,12 +805,24 @@ lval* lval_read(mpc_ast_t* t) {
 void lval_del(lval* v) {
 
     switch (v->type) {
-        /* Do nothing special for number type */
-        case LVAL_NUM: break;
+        /* For Number free the separately allocated value */
+        case LVAL_NUM: mem_free(v->num, sizeof(union Number)); break;
+
+            /* For Err free the string data, symbol names are interned */
+        case LVAL_ERR: mem_free(v->err, strlen(v->err) + 1); break;
+        case LVAL_SYM: break;
 
-            /* For Err or Sym free the string data */
-        case LVAL_ERR: free(v->err); break;
-        case LVAL_SYM: free(v->sym); break;
+        case LVAL_FUN:
+            if (v->proto) { lproto_release(v->proto); }
+            if (v->env) { lenv_release(v->env); }
+            if (v->memo) { lmemo_release(v->memo); }
+            break;
+
+        case LVAL_SEQ: lseq_release(v->seq); break;
+        case LVAL_FUTURE: lfuture_release(v->future); break;
+        case LVAL_CHAN: lchan_release(v->chan); break;
+        case LVAL_ACTOR: lactor_release(v->actor); break;
+        case LVAL_HMAP: lhmap_release(v->hmap); break;
 
         /* If Sexpr OS Qexpr then delete all elements inside */
         case LVAL_QEXPR:
@@ -163,287 +831,5794 @@ void lval_del(lval* v) {
                 lval_del(v->cell[i]);
             }
             /* Also free the memory allocated to contain the pointers */
-            free(v->cell);
+            cells_free(v->cell);
+            lval_uncache(v);
             break;
     }
 
     /* Free the memory allocated for the "lval" struct itself */
-    free(v);
+    mem_free(v, sizeof(lval));
 }
 
-void lval_expr_print(lval* v, char open, char close);
+lval* lval_copy(lval* v) {
+    lval* x = mem_alloc(sizeof(lval));
+    x->type = v->type;
 
-void lval_print(lval* v) {
     switch (v->type) {
         case LVAL_NUM:
-            if (v->num_type == LVAL_LONG) { printf("%li", v->num->long_num); }
-            if (v->num_type == LVAL_DOUBLE) { printf("%f", v->num->double_num); }
+            x->num = mem_alloc(sizeof(union Number));
+            *x->num = *v->num;
+            x->num_type = v->num_type;
             break;
-        case LVAL_ERR:   printf("Error: %s", v->err); break;
-        case LVAL_SYM:   printf("%s", v->sym); break;
-        case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
-        case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
-    }
-}
 
-void lval_expr_print(lval* v, char open, char close) {
-    putchar(open);
-    for (int i = 0; i < v->count; i++) {
+        /* Copy Strings using malloc and strcpy */
+        case LVAL_ERR:
+            x->err = mem_alloc(strlen(v->err) + 1);
+            strcpy(x->err, v->err);
+            break;
+        case LVAL_SYM:
+            x->sym = v->sym;
+            x->depth = v->depth;
+            x->slot = v->slot;
+            break;
 
-        /* Print Value contained within */
-        lval_print(v->cell[i]);
+        /* Functions share their prototype and frame */
+        case LVAL_FUN:
+            x->builtin = v->builtin;
+            x->proto = v->proto;
+            x->env = v->env;
+            x->memo = v->memo;
+            if (x->proto) { ref_inc(&x->proto->refs); }
+            if (x->env) { ref_inc(&x->env->refs); }
+            if (x->memo) { ref_inc(&x->memo->refs); }
+            break;
 
-        /* Don't print trailing space if last element */
-        if (i != (v->count-1)) {
-            putchar(' ');
-        }
-    }
-    putchar(close);
-}
+        case LVAL_SEQ:
+            x->seq = v->seq;
+            ref_inc(&x->seq->refs);
+            break;
 
+        case LVAL_FUTURE:
+            x->future = v->future;
+            ref_inc(&x->future->refs);
+            break;
 
-void lval_println(lval* v) {
-    lval_print(v);
-    putchar('\n');
-}
+        case LVAL_CHAN:
+            x->chan = v->chan;
+            ref_inc(&x->chan->refs);
+            break;
 
-int number_of_leaves(mpc_ast_t* tree){
-    if (tree->children_num == 0) { return 1; }
+        case LVAL_ACTOR:
+            x->actor = v->actor;
+            ref_inc(&x->actor->refs);
+            break;
 
-    int leaves_count = 0;
-    for (int i=0; i < tree->children_num; i++) {
-        leaves_count += number_of_leaves(tree->children[i]);
+        case LVAL_HMAP:
+            x->hmap = v->hmap;
+            ref_inc(&x->hmap->refs);
+            break;
+
+        /* Copy Lists by copying each sub-expression, compiled code is shared */
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            x->count = v->count;
+            x->cell = cells_resize(NULL, x->count);
+            for (int i = 0; i < x->count; i++) {
+                x->cell[i] = lval_copy(v->cell[i]);
+            }
+            x->code = v->code;
+            if (x->code) { ref_inc(&x->code->refs); }
+            x->weight = 0;
+            x->hash = v->hash;
+            x->proto = v->proto;
+            if (x->proto) { ref_inc(&x->proto->refs); }
+            break;
     }
 
-    return leaves_count;
+    return x;
 }
 
-lval* lval_pop(lval* v, int i) {
-    /* Find the item at "i" */
-    lval* x = v->cell[i];
-
-    /* Shift memory after the item at "i" over the top */
-    memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+vval vval_long(long x) { vval r; r.tag = VV_LONG; r.l = x; return r; }
+vval vval_double(double x) { vval r; r.tag = VV_DOUBLE; r.d = x; return r; }
+vval vval_lval(lval* x) { vval r; r.tag = VV_LVAL; r.v = x; return r; }
+vval vval_err(char* m) { return vval_lval(lval_err(m)); }
 
-    /* Decrease the count of items in the list */
-    v->count--;
+int vval_is_err(vval x) { return x.tag == VV_LVAL && x.v->type == LVAL_ERR; }
 
-    /* Reallocate the memory used */
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    return x;
+void vval_del(vval x) {
+    if (x.tag == VV_LVAL) { lval_del(x.v); }
 }
 
-lval* lval_take(lval* v, int i) {
-    lval* x = lval_pop(v, i);
-    lval_del(v);
+vval vval_dup(vval x) {
+    if (x.tag == VV_LVAL) { x.v = lval_copy(x.v); }
     return x;
 }
 
-
-void lval_add_op(lval* x, lval* y) {
-    if (x->num_type == LVAL_LONG) {x->num->long_num += y->num->long_num; }
-    if (x->num_type == LVAL_DOUBLE) { x->num->double_num += y->num->double_num; }
+/* A copy of "x", unboxed when it is a number */
+vval vval_copy_of(lval* x) {
+    if (x->type != LVAL_NUM) { return vval_lval(lval_copy(x)); }
+    return x->num_type == LVAL_LONG
+        ? vval_long(x->num->long_num)
+        : vval_double(x->num->double_num);
 }
 
-void lval_sub_op(lval* x, lval* y) {
-    if (x->num_type == LVAL_LONG) {x->num->long_num -= y->num->long_num; }
-    if (x->num_type == LVAL_DOUBLE) { x->num->double_num -= y->num->double_num; }
+/* Take ownership of "x", unboxing numbers */
+vval vval_from_lval(lval* x) {
+    if (x->type != LVAL_NUM) { return vval_lval(x); }
+    vval r = x->num_type == LVAL_LONG
+        ? vval_long(x->num->long_num)
+        : vval_double(x->num->double_num);
+    lval_del(x);
+    return r;
 }
 
-void lval_div_op(lval* x, lval* y) {
-    if (x->num_type == LVAL_LONG) {x->num->long_num /= y->num->long_num; }
-    if (x->num_type == LVAL_DOUBLE) { x->num->double_num /= y->num->double_num; }
+lval* vval_to_lval(vval x) {
+    if (x.tag == VV_LONG) { return lval_long_num(x.l); }
+    if (x.tag == VV_DOUBLE) { return lval_double_num(x.d); }
+    return x.v;
 }
 
-void lval_fmod_op(lval* x, lval* y) {
-    if (x->num_type == LVAL_LONG) {x->num->long_num %= y->num->long_num; }
-    if (x->num_type == LVAL_DOUBLE) { x->num->double_num = fmod(x->num->double_num, y->num->double_num); }
-}
+/* Global definitions, an open addressing table keyed by interned name */
+typedef struct gslot {
+    char* sym;
+    lval* v;
 
-void lval_mil_op(lval* x, lval* y) {
-    if (x->num_type == LVAL_LONG) {x->num->long_num *= y->num->long_num; }
-    if (x->num_type == LVAL_DOUBLE) { x->num->double_num *= y->num->double_num; }
-}
+    /* Bound to a builtin for good */
+    int fixed;
+} gslot;
 
-lval* builtin_op(lval* a, char* op) {
+typedef struct genv {
+    gslot* slots;
+    int cap;
+    int count;
+} genv;
 
-    /* Ensure all arguments are numbers */
-    for (int i = 0; i < a->count; i++) {
-        if (a->cell[i]->type != LVAL_NUM) {
-            lval_del(a);
-            return lval_err("Cannot operate on non-number!");
-        }
-    }
+genv globals = { NULL, 0, 0 };
 
-    /* Pop the first element */
-    lval* x = lval_pop(a, 0);
+/* Bumped by every definition, so what was looked up before is stale */
+long global_version = 1;
 
-    /* If no arguments and sub then perform unary negation */
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        if (x->num_type == LVAL_LONG){ x->num->long_num = -x->num->long_num; }
-        if (x->num_type == LVAL_DOUBLE){ x->num->double_num = -x->num->double_num; }
+/* Tasks look definitions up while the main thread makes them. Values
+   they replace may still be in use by a task, and are kept until none
+   is running */
+pthread_rwlock_t global_lock = PTHREAD_RWLOCK_INITIALIZER;
+lval** global_retired = NULL;
+int global_nretired = 0;
+
+int code_claim(void);
+void code_release(void);
+
+gslot* global_slot(char* sym) {
+    if (!globals.cap) { return NULL; }
+    for (int i = hash_ptr(sym) & (globals.cap - 1); globals.slots[i].sym; i = (i + 1) & (globals.cap - 1)) {
+        if (globals.slots[i].sym == sym) { return &globals.slots[i]; }
     }
+    return NULL;
+}
 
-    /* While there are still elements remaining */
-    while (a->count > 0) {
+/* The value bound to "sym", still owned by the table, or NULL */
+lval* global_get(char* sym) {
+    if (threaded) { pthread_rwlock_rdlock(&global_lock); }
+    gslot* g = global_slot(sym);
+    lval* v = g ? g->v : NULL;
+    if (threaded) { pthread_rwlock_unlock(&global_lock); }
+    return v;
+}
 
-        /* Pop the next element */
-        lval* y = lval_pop(a, 0);
+/* The builtin named "sym". Builtins can't be redefined, so code calling
+   one can be bound to it before it runs */
+lval* global_builtin(char* sym) {
+    if (threaded) { pthread_rwlock_rdlock(&global_lock); }
+    gslot* g = global_slot(sym);
+    lval* v = g && g->fixed ? g->v : NULL;
+    if (threaded) { pthread_rwlock_unlock(&global_lock); }
+    return v;
+}
 
-        if (x->num_type != y->num_type) {
-            lval_del(x); lval_del(y);
-            x = lval_err("Different types of operands!"); break;
+void global_put_locked(char* sym, lval* v) {
+    gslot* g = global_slot(sym);
+    if (g) {
+        if (threaded) {
+            global_retired = realloc(global_retired, sizeof(lval*) * (global_nretired + 1));
+            global_retired[global_nretired++] = g->v;
+        } else {
+            lval_del(g->v);
         }
+        g->v = v;
+        return;
+    }
 
-        if (strcmp(op, "+") == 0) { lval_add_op(x, y); }
-        if (strcmp(op, "-") == 0) { lval_sub_op(x, y); }
-        if (strcmp(op, "*") == 0) { lval_mil_op(x, y); }
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x); lval_del(y);
-                x = lval_err("Division By Zero!"); break;
-            }
-            lval_div_op(x, y);
+    /* Keep the table at most half full */
+    if (2 * (globals.count + 1) > globals.cap) {
+        int cap = globals.cap ? globals.cap * 2 : 64;
+        gslot* slots = calloc(cap, sizeof(gslot));
+        for (int i = 0; i < globals.cap; i++) {
+            if (!globals.slots[i].sym) { continue; }
+            int j = hash_ptr(globals.slots[i].sym) & (cap - 1);
+            while (slots[j].sym) { j = (j + 1) & (cap - 1); }
+            slots[j] = globals.slots[i];
         }
-        if (strcmp(op, "%") == 0) {
-            if (y->num == 0) {
-                lval_del(x); lval_del(y);
-                x = lval_err("Division By Zero!"); break;
-            }
-            lval_fmod_op(x, y);
-        }
-
-        lval_del(y);
+        free(globals.slots);
+        globals.slots = slots;
+        globals.cap = cap;
     }
 
-    lval_del(a);
-    return x;
+    int i = hash_ptr(sym) & (globals.cap - 1);
+    while (globals.slots[i].sym) { i = (i + 1) & (globals.cap - 1); }
+    globals.slots[i].sym = sym;
+    globals.slots[i].v = v;
+    globals.slots[i].fixed = 0;
+    globals.count++;
 }
 
-lval* lval_eval(lval* v);
+/* Bind "sym" to "v", replacing any earlier definition. The version is
+   bumped after, so a cache filled with it holds the new value */
+void global_put(char* sym, lval* v) {
+    if (!threaded) {
+        global_put_locked(sym, v);
+        global_version++;
+        return;
+    }
 
-lval* builtin_head(lval* a) {
-    LASSERT(a, a->count == 1,"Function 'head' passed too many arguments!");
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,"Function 'head' passed incorrect type!");
-    LASSERT(a, a->cell[0]->count != 0,"Function 'head' passed {}!");
+    pthread_rwlock_wrlock(&global_lock);
+    global_put_locked(sym, v);
+    pthread_rwlock_unlock(&global_lock);
+    __atomic_add_fetch(&global_version, 1, __ATOMIC_RELEASE);
+    if (code_claim()) {
+        while (global_nretired > 0) { lval_del(global_retired[--global_nretired]); }
+        code_release();
+    }
+}
 
-    /* Otherwise take first argument */
-    lval* v = lval_take(a, 0);
+/* Scope named by every "step"th symbol of "names", inside "parent" */
+lscope* lscope_new(lval* names, int step, lscope* parent) {
+    lscope* s = malloc(sizeof(lscope));
+    s->refs = 1;
+    s->count = (names->count + step - 1) / step;
+    s->names = malloc(sizeof(char*) * ((unsigned)s->count + 1));
+    for (int i = 0; i < s->count; i++) { s->names[i] = names->cell[i * step]->sym; }
+    s->parent = parent;
+    if (parent) { ref_inc(&parent->refs); }
+    s->ncaptures = 0;
+    s->captures = NULL;
+    s->fixed = 0;
+    return s;
+}
 
-    /* Delete all elements that are not head and return */
-    while (v->count > 1) {
-        lval_del(lval_pop(v, 1));
+void lscope_release(lscope* s) {
+    while (s && ref_dec(&s->refs) == 0) {
+        lscope* parent = s->parent;
+        free(s->names);
+        free(s->captures);
+        free(s);
+        s = parent;
     }
-    return v;
 }
 
-lval* builtin_tail(lval* a) {
-    LASSERT(a, a->count == 1,"Function 'tail' passed too many arguments!");
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,"Function 'tail' passed incorrect type!");
-    LASSERT(a, a->cell[0]->count != 0,"Function 'tail' passed {}!");
+void lproto_release(lproto* p) {
+    if (ref_dec(&p->refs) > 0) { return; }
+    lscope_release(p->scope);
+    lscope_release(p->captures);
+    lval_del(p->from);
+    lval_del(p->body);
+    if (p->code) { chunk_release(p->code); }
+    free(p);
+}
 
-    /* Take first argument */
-    lval* v = lval_take(a, 0);
+void lseq_release(lseq* s) {
+    if (ref_dec(&s->refs) > 0) { return; }
+    if (s->f) { lval_del(s->f); }
+    if (s->x) { lval_del(s->x); }
+    if (s->src) { lval_del(s->src); }
+    free(s);
+}
 
-    /* Delete first element and return */
-    lval_del(lval_pop(v, 0));
-    return v;
+void lfuture_release(lfuture* f) {
+    if (ref_dec(&f->refs) > 0) { return; }
+    if (f->code) { lval_del(f->code); }
+    if (f->e) { lenv_release(f->e); }
+    if (f->result) { lval_del(f->result); }
+    free(f);
 }
 
-lval* builtin_list(lval* a) {
-    a->type = LVAL_QEXPR;
+/* Frame with a slot for each name of "scope", filled in by the caller */
+lenv* lenv_new(lscope* scope, lenv* parent) {
+    lenv* e = malloc(sizeof(lenv) + sizeof(vval) * scope->count);
+    e->refs = 1;
+    e->parent = parent;
+    if (parent) { ref_inc(&parent->refs); }
+    e->scope = scope;
+    ref_inc(&scope->refs);
+    return e;
+}
+
+void lenv_release(lenv* e) {
+    while (e && ref_dec(&e->refs) == 0) {
+        lenv* parent = e->parent;
+        for (int i = 0; i < e->scope->count; i++) { vval_del(e->slots[i]); }
+        lscope_release(e->scope);
+        free(e);
+        e = parent;
+    }
+}
+
+/* Slot of local variable "s" seen from frame "e", or NULL when it isn't
+   a local. A resolved symbol goes straight to its slot; the slot's name
+   is still checked, since code can be evaluated in a frame it wasn't
+   resolved for (a Q-expression passed out of a lambda), and then the
+   variable is found by name instead */
+vval* lenv_slot(lenv* e, lval* s) {
+    if (s->depth < 0) { return NULL; }
+
+    lenv* f = e;
+    for (int d = s->depth; f && d > 0; d--) { f = f->parent; }
+    if (f && s->slot < f->scope->count && f->scope->names[s->slot] == s->sym) {
+        return &f->slots[s->slot];
+    }
+
+    for (f = e; f; f = f->parent) {
+        for (int i = 0; i < f->scope->count; i++) {
+            if (f->scope->names[i] == s->sym) { return &f->slots[i]; }
+        }
+    }
+    return NULL;
+}
+
+/* Value of symbol "s" in frame "e", a local or else a global */
+vval lenv_get(lenv* e, lval* s) {
+    vval* x = lenv_slot(e, s);
+    if (x) { return vval_dup(*x); }
+
+    lval* v = global_get(s->sym);
+    if (v) { return vval_copy_of(v); }
+    return vval_lval(lval_err("Unbound Symbol '%s'", s->sym));
+}
+
+/* Output buffer: printed text is collected here and handed to the fd in
+   large writes, or kept in memory when rendering to a string (fd == -1) */
+#define LBUF_FLUSH (1 << 22)
+#define LBUF_STREAM_FLUSH (1 << 16)
+
+typedef struct lbuf {
+    char* data;
+    size_t len;
+    size_t cap;
+    size_t flush_at;
+    size_t total;
+    int fd;
+} lbuf;
+
+/* Limits applied when printing results, 0 means unlimited */
+typedef struct lprint_limits {
+    long max_elems;
+    long max_depth;
+    size_t max_bytes;
+} lprint_limits;
+
+lprint_limits print_limits = { 0, 0, 0 };
+
+/* Streaming mode writes small chunks as soon as they are ready */
+int print_stream = 0;
+
+void lbuf_init(lbuf* b, int fd) {
+    b->data = NULL;
+    b->len = 0;
+    b->cap = 0;
+    b->flush_at = print_stream ? LBUF_STREAM_FLUSH : LBUF_FLUSH;
+    b->total = 0;
+    b->fd = fd;
+}
+
+void lbuf_flush(lbuf* b) {
+    if (b->fd < 0) { return; }
+
+    size_t done = 0;
+    while (done < b->len) {
+        ssize_t n = write(b->fd, b->data + done, b->len - done);
+        if (n < 0 && errno == EINTR) { continue; }
+
+        /* Non-blocking output is full, wait until the reader catches up */
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd p = { b->fd, POLLOUT, 0 };
+            poll(&p, 1, -1);
+            continue;
+        }
+
+        /* Nothing sensible to do with a broken output, drop the text */
+        if (n <= 0) { break; }
+        done += n;
+    }
+    b->len = 0;
+}
+
+void lbuf_reserve(lbuf* b, size_t n) {
+    if (b->fd >= 0 && b->len + n > b->flush_at) { lbuf_flush(b); }
+    b->total += n;
+    if (b->len + n <= b->cap) { return; }
+
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + n) { cap *= 2; }
+    b->data = realloc(b->data, cap);
+    b->cap = cap;
+}
+
+void lbuf_write(lbuf* b, const char* s, size_t n) {
+    lbuf_reserve(b, n);
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+void lbuf_putc(lbuf* b, char c) {
+    lbuf_reserve(b, 1);
+    b->data[b->len++] = c;
+}
+
+void lbuf_puts(lbuf* b, const char* s) {
+    lbuf_write(b, s, strlen(s));
+}
+
+void lbuf_long(lbuf* b, long x) {
+    /* Digits are produced backwards, so fill a scratch buffer from the end */
+    char tmp[24];
+    char* p = tmp + sizeof(tmp);
+    unsigned long u = x < 0 ? -(unsigned long)x : (unsigned long)x;
+    do { *--p = (char)('0' + u % 10); u /= 10; } while (u);
+    if (x < 0) { *--p = '-'; }
+    lbuf_write(b, p, tmp + sizeof(tmp) - p);
+}
+
+void lbuf_double(lbuf* b, double x) {
+    char tmp[512];
+    int n = snprintf(tmp, sizeof(tmp), "%f", x);
+    lbuf_write(b, tmp, n < (int)sizeof(tmp) ? n : (int)sizeof(tmp) - 1);
+}
+
+/* Hand over the collected text as a NUL terminated string */
+char* lbuf_str(lbuf* b) {
+    lbuf_putc(b, '\0');
+    char* s = b->data;
+    lbuf_init(b, b->fd);
+    return s;
+}
+
+void lbuf_free(lbuf* b) {
+    lbuf_flush(b);
+    free(b->data);
+    lbuf_init(b, b->fd);
+}
+
+
+int lval_write(lbuf* b, lval* v, lprint_limits* lim);
+
+/* A lambda is shown as the code that makes it, with its body as resolved
+   and optimized */
+void lval_write_lambda(lbuf* b, lproto* p) {
+    lbuf_puts(b, "(\\ {");
+    for (int i = 0; i < p->scope->count; i++) {
+        if (i > 0) { lbuf_putc(b, ' '); }
+        lbuf_puts(b, p->scope->names[i]);
+    }
+    lbuf_puts(b, "} {");
+    if (p->body->type == LVAL_SEXPR) {
+        for (int i = 0; i < p->body->count; i++) {
+            if (i > 0) { lbuf_putc(b, ' '); }
+            lval_write(b, p->body->cell[i], NULL);
+        }
+    } else {
+        lval_write(b, p->body, NULL);
+    }
+    lbuf_puts(b, "})");
+}
+
+void lval_write_atom(lbuf* b, lval* v) {
+    switch (v->type) {
+        case LVAL_NUM:
+            if (v->num_type == LVAL_LONG) { lbuf_long(b, v->num->long_num); }
+            if (v->num_type == LVAL_DOUBLE) { lbuf_double(b, v->num->double_num); }
+            break;
+        case LVAL_ERR: lbuf_puts(b, "Error: "); lbuf_puts(b, v->err); break;
+        case LVAL_SYM: lbuf_puts(b, v->sym); break;
+        case LVAL_FUN:
+            if (v->memo) {
+                lbuf_puts(b, "<memo>");
+            } else if (v->builtin) {
+                lbuf_puts(b, "<builtin>");
+            } else {
+                lval_write_lambda(b, v->proto);
+            }
+            break;
+        case LVAL_SEQ:
+            if (v->seq->kind == SEQ_RANGE) {
+                lbuf_puts(b, "<range ");
+                lbuf_long(b, v->seq->start);
+                lbuf_putc(b, ' ');
+                lbuf_long(b, v->seq->end);
+                lbuf_putc(b, ' ');
+                lbuf_long(b, v->seq->step);
+                lbuf_putc(b, '>');
+            } else {
+                static char* names[] = { "", "<iterate>", "<generate>", "<seq>", "<map>", "<filter>" };
+                lbuf_puts(b, names[v->seq->kind]);
+            }
+            break;
+        case LVAL_FUTURE: lbuf_puts(b, "<future>"); break;
+        case LVAL_CHAN: lbuf_puts(b, "<chan>"); break;
+        case LVAL_ACTOR: lbuf_puts(b, "<actor>"); break;
+    }
+}
+
+int vval_write(lbuf* b, vval x, lprint_limits* lim) {
+    if (x.tag == VV_LONG) { lbuf_long(b, x.l); return 0; }
+    if (x.tag == VV_DOUBLE) { lbuf_double(b, x.d); return 0; }
+    return lval_write(b, x.v, lim);
+}
+
+/* Maps being written by this thread, outermost first */
+#define HMAP_WRITE_DEPTH 32
+_Thread_local lhmap* hmap_writing[HMAP_WRITE_DEPTH];
+_Thread_local int hmap_writing_count = 0;
+
+/* A map is shown as the code that makes it. Limits apply to its keys and
+   values as to the elements of a list. A map inside itself is elided */
+int lval_write_hmap(lbuf* b, lhmap* m, lprint_limits* lim) {
+    int inside = hmap_writing_count == HMAP_WRITE_DEPTH;
+    for (int i = 0; i < hmap_writing_count; i++) { inside |= hmap_writing[i] == m; }
+    if (inside) {
+        lbuf_puts(b, "(hmap {...})");
+        return 1;
+    }
+    hmap_writing[hmap_writing_count++] = m;
+
+    lprint_limits none = { 0, 0, 0 };
+    if (!lim) { lim = &none; }
+    size_t max_total = lim->max_bytes ? b->total + lim->max_bytes : 0;
+    int elided = 0;
+    long n = 0;
+
+    if (threaded) { pthread_mutex_lock(&m->lock); }
+    lbuf_puts(b, "(hmap {");
+    for (long i = 0; i < m->cap; i++) {
+        if (m->ctrl[i] < 0) { continue; }
+        if ((lim->max_elems && n >= lim->max_elems) || (max_total && b->total >= max_total)) {
+            lbuf_puts(b, " ...");
+            elided = 1;
+            break;
+        }
+        if (n > 0) { lbuf_putc(b, ' '); }
+        elided |= vval_write(b, m->slots[i].key, lim);
+        lbuf_putc(b, ' ');
+        elided |= vval_write(b, m->slots[i].value, lim);
+        n += 2;
+    }
+    lbuf_puts(b, "})");
+    if (threaded) { pthread_mutex_unlock(&m->lock); }
+
+    hmap_writing_count--;
+    return elided;
+}
+
+char lval_open_char(lval* v) { return v->type == LVAL_SEXPR ? '(' : '{'; }
+char lval_close_char(lval* v) { return v->type == LVAL_SEXPR ? ')' : '}'; }
+
+/* Serialize "v" into the buffer. Nested lists are walked with an explicit
+   stack so that deep results cannot overflow the C stack. With limits set,
+   long lists, deep lists and long output are cut short with "..." and 1 is
+   returned */
+int lval_write(lbuf* b, lval* v, lprint_limits* lim) {
+    if (v->type == LVAL_HMAP) { return lval_write_hmap(b, v->hmap, lim); }
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+        lval_write_atom(b, v);
+        return 0;
+    }
+
+    lprint_limits none = { 0, 0, 0 };
+    if (!lim) { lim = &none; }
+    size_t max_total = lim->max_bytes ? b->total + lim->max_bytes : 0;
+    int elided = 0;
+
+    typedef struct { lval* v; int i; } frame;
+    int depth = 0;
+    int cap = 16;
+    frame* stack = malloc(sizeof(frame) * cap);
+
+    lbuf_putc(b, lval_open_char(v));
+    stack[0].v = v;
+    stack[0].i = 0;
+
+    while (depth >= 0) {
+        frame* f = &stack[depth];
+
+        /* Out of bytes, close everything still open and stop */
+        if (max_total && b->total >= max_total) {
+            lbuf_puts(b, " ...");
+            for (; depth >= 0; depth--) { lbuf_putc(b, lval_close_char(stack[depth].v)); }
+            elided = 1;
+            break;
+        }
+
+        /* Too many elements, skip the rest of this list */
+        if (lim->max_elems && f->i == lim->max_elems && f->i < f->v->count) {
+            lbuf_puts(b, " ...");
+            f->i = f->v->count;
+            elided = 1;
+        }
+
+        /* List finished, close it and resume the parent */
+        if (f->i == f->v->count) {
+            lbuf_putc(b, lval_close_char(f->v));
+            depth--;
+            continue;
+        }
+
+        /* Don't print trailing space if last element */
+        if (f->i > 0) { lbuf_putc(b, ' '); }
+        lval* x = f->v->cell[f->i++];
+
+        if (x->type == LVAL_HMAP) {
+            elided |= lval_write_hmap(b, x->hmap, lim);
+            continue;
+        }
+        if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) {
+            lval_write_atom(b, x);
+            continue;
+        }
+
+        lbuf_putc(b, lval_open_char(x));
+
+        /* Too deep, show the list as elided without descending */
+        if (lim->max_depth && depth + 1 >= lim->max_depth && x->count > 0) {
+            lbuf_puts(b, "...");
+            lbuf_putc(b, lval_close_char(x));
+            elided = 1;
+            continue;
+        }
+
+        if (++depth == cap) {
+            cap *= 2;
+            stack = realloc(stack, sizeof(frame) * cap);
+        }
+        stack[depth].v = x;
+        stack[depth].i = 0;
+    }
+
+    free(stack);
+    return elided;
+}
+
+/* Count the values in "v" and its nesting depth, without recursion. The
+   keys and values of a map are counted without looking into them */
+void lval_size(lval* v, long* values, long* depth) {
+    *values = 0;
+    *depth = 0;
+
+    typedef struct { lval* v; int i; } frame;
+    int top = -1;
+    int cap = 16;
+    frame* stack = malloc(sizeof(frame) * cap);
+
+    lval* x = v;
+    while (1) {
+        (*values)++;
+        if (x->type == LVAL_HMAP) { *values += 2 * x->hmap->count; }
+        if ((x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) && x->count > 0) {
+            if (++top == cap) {
+                cap *= 2;
+                stack = realloc(stack, sizeof(frame) * cap);
+            }
+            stack[top].v = x;
+            stack[top].i = 0;
+            if (top + 1 > *depth) { *depth = top + 1; }
+        }
+
+        while (top >= 0 && stack[top].i == stack[top].v->count) { top--; }
+        if (top < 0) { break; }
+        x = stack[top].v->cell[stack[top].i++];
+    }
+
+    free(stack);
+}
+
+/* Render "v" into a newly allocated string, caller frees it */
+char* lval_to_str(lval* v) {
+    lbuf b;
+    lbuf_init(&b, -1);
+    lval_write(&b, v, NULL);
+    return lbuf_str(&b);
+}
+
+void lval_print_to(int fd, lval* v, int newline) {
+    /* Anything still sitting in stdio has to reach the fd first */
+    fflush(stdout);
+
+    lbuf b;
+    lbuf_init(&b, fd);
+
+    /* When something was cut off, report how big the whole value is */
+    if (lval_write(&b, v, &print_limits)) {
+        long values, depth;
+        lval_size(v, &values, &depth);
+        lbuf_puts(&b, " ; ");
+        lbuf_long(&b, values);
+        lbuf_puts(&b, " values, depth ");
+        lbuf_long(&b, depth);
+    }
+
+    if (newline) { lbuf_putc(&b, '\n'); }
+    lbuf_free(&b);
+}
+
+void lval_print(lval* v) {
+    lval_print_to(STDOUT_FILENO, v, 0);
+}
+
+void lval_println(lval* v) {
+    lval_print_to(STDOUT_FILENO, v, 1);
+}
+
+int number_of_leaves(mpc_ast_t* tree){
+    if (tree->children_num == 0) { return 1; }
+
+    int leaves_count = 0;
+    for (int i=0; i < tree->children_num; i++) {
+        leaves_count += number_of_leaves(tree->children[i]);
+    }
+
+    return leaves_count;
+}
+
+lval* lval_pop(lval* v, int i) {
+    lval_uncache(v);
+
+    /* Find the item at "i" */
+    lval* x = v->cell[i];
+
+    /* Shift memory after the item at "i" over the top */
+    memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+
+    /* Decrease the count of items in the list */
+    v->count--;
+
+    /* Reallocate the memory used */
+    v->cell = cells_resize(v->cell, v->count);
+    return x;
+}
+
+lval* lval_take(lval* v, int i) {
+    lval* x = lval_pop(v, i);
+    lval_del(v);
+    return x;
+}
+
+
+/* The one long division that doesn't fit, and traps */
+int div_overflows(long x, long y) { return x == LONG_MIN && y == -1; }
+
+int lval_is_zero(lval* x) {
+    if (x->num_type == LVAL_LONG) { return x->num->long_num == 0; }
+    return x->num->double_num == 0;
+}
+
+void lval_add_op(lval* x, lval* y) {
+    if (x->num_type == LVAL_LONG) {x->num->long_num += y->num->long_num; }
+    if (x->num_type == LVAL_DOUBLE) { x->num->double_num += y->num->double_num; }
+}
+
+void lval_sub_op(lval* x, lval* y) {
+    if (x->num_type == LVAL_LONG) {x->num->long_num -= y->num->long_num; }
+    if (x->num_type == LVAL_DOUBLE) { x->num->double_num -= y->num->double_num; }
+}
+
+void lval_div_op(lval* x, lval* y) {
+    if (x->num_type == LVAL_LONG) {x->num->long_num /= y->num->long_num; }
+    if (x->num_type == LVAL_DOUBLE) { x->num->double_num /= y->num->double_num; }
+}
+
+void lval_fmod_op(lval* x, lval* y) {
+    if (x->num_type == LVAL_LONG) {x->num->long_num %= y->num->long_num; }
+    if (x->num_type == LVAL_DOUBLE) { x->num->double_num = fmod(x->num->double_num, y->num->double_num); }
+}
+
+void lval_mil_op(lval* x, lval* y) {
+    if (x->num_type == LVAL_LONG) {x->num->long_num *= y->num->long_num; }
+    if (x->num_type == LVAL_DOUBLE) { x->num->double_num *= y->num->double_num; }
+}
+
+/* "x op y" for numbers of any type, consumes both */
+lval* lval_op(lval* x, lval* y, char* op) {
+    if (x->num_type != y->num_type) {
+        lval_del(x); lval_del(y);
+        return lval_err("Different types of operands!");
+    }
+
+    if (strcmp(op, "+") == 0) { lval_add_op(x, y); }
+    if (strcmp(op, "-") == 0) { lval_sub_op(x, y); }
+    if (strcmp(op, "*") == 0) { lval_mil_op(x, y); }
+    if (strcmp(op, "/") == 0 || strcmp(op, "%") == 0) {
+        if (lval_is_zero(y)) {
+            lval_del(x); lval_del(y);
+            return lval_err("Division By Zero!");
+        }
+        if (x->num_type == LVAL_LONG && div_overflows(x->num->long_num, y->num->long_num)) {
+            lval_del(x); lval_del(y);
+            return lval_err("Division Overflow!");
+        }
+        if (op[0] == '/') { lval_div_op(x, y); } else { lval_fmod_op(x, y); }
+    }
+
+    lval_del(y);
+    return x;
+}
+
+lval* lval_reduce(lval* s, char* op);
+
+lval* builtin_op(lval* a, char* op) {
+
+    /* A single sequence is folded over, one value at a time */
+    if (a->count == 1 && a->cell[0]->type == LVAL_SEQ) { return lval_reduce(lval_take(a, 0), op); }
+
+    /* Ensure all arguments are numbers */
+    for (int i = 0; i < a->count; i++) {
+        if (a->cell[i]->type != LVAL_NUM) {
+            lval_del(a);
+            return lval_err("Cannot operate on non-number!");
+        }
+    }
+
+    /* Pop the first element */
+    lval* x = lval_pop(a, 0);
+
+    /* If no arguments and sub then perform unary negation */
+    if ((strcmp(op, "-") == 0) && a->count == 0) {
+        if (x->num_type == LVAL_LONG){ x->num->long_num = -x->num->long_num; }
+        if (x->num_type == LVAL_DOUBLE){ x->num->double_num = -x->num->double_num; }
+    }
+
+    /* While there are still elements remaining */
+    while (a->count > 0) {
+        x = lval_op(x, lval_pop(a, 0), op);
+        if (x->type == LVAL_ERR) { break; }
+    }
+
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_add(lenv* e, lval* a) { return builtin_op(a, "+"); }
+lval* builtin_sub(lenv* e, lval* a) { return builtin_op(a, "-"); }
+lval* builtin_mul(lenv* e, lval* a) { return builtin_op(a, "*"); }
+lval* builtin_div(lenv* e, lval* a) { return builtin_op(a, "/"); }
+lval* builtin_mod(lenv* e, lval* a) { return builtin_op(a, "%"); }
+
+enum { CMP_LT, CMP_GT, CMP_LE, CMP_GE, CMP_EQ, CMP_NE };
+
+int cmp_kind(char* sym) {
+    if (strcmp(sym, "<") == 0) { return CMP_LT; }
+    if (strcmp(sym, ">") == 0) { return CMP_GT; }
+    if (strcmp(sym, "<=") == 0) { return CMP_LE; }
+    if (strcmp(sym, ">=") == 0) { return CMP_GE; }
+    if (strcmp(sym, "==") == 0) { return CMP_EQ; }
+    if (strcmp(sym, "!=") == 0) { return CMP_NE; }
+    return -1;
+}
+
+/* Whether comparison "k" holds for operands whose difference has "sign" */
+int cmp_holds(int k, int sign) {
+    switch (k) {
+        case CMP_LT: return sign < 0;
+        case CMP_GT: return sign > 0;
+        case CMP_LE: return sign <= 0;
+        case CMP_GE: return sign >= 0;
+        case CMP_EQ: return sign == 0;
+    }
+    return sign != 0;
+}
+
+int lval_eq(lval* x, lval* y);
+
+/* Compare two numbers of the same type, giving 1 or 0. Any other values
+   can be compared for equality, which goes by their structure */
+lval* builtin_cmp(lval* a, char* op) {
+    if (a->count != 2) {
+        lval_del(a);
+        return lval_err("Function '%s' passed incorrect number of arguments!", op);
+    }
+
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    int k = cmp_kind(op);
+    if ((k == CMP_EQ || k == CMP_NE) && (x->type != LVAL_NUM || y->type != LVAL_NUM)) {
+        lval* r = lval_long_num(lval_eq(x, y) == (k == CMP_EQ));
+        lval_del(a);
+        return r;
+    }
+    LASSERT(a, x->type == LVAL_NUM && y->type == LVAL_NUM, "Cannot operate on non-number!");
+    LASSERT(a, x->num_type == y->num_type, "Different types of operands!");
+
+    int sign;
+    if (x->num_type == LVAL_LONG) {
+        sign = (x->num->long_num > y->num->long_num) - (x->num->long_num < y->num->long_num);
+    } else {
+        sign = (x->num->double_num > y->num->double_num) - (x->num->double_num < y->num->double_num);
+    }
+    lval* r = lval_long_num(cmp_holds(k, sign));
+    lval_del(a);
+    return r;
+}
+
+lval* builtin_lt(lenv* e, lval* a) { return builtin_cmp(a, "<"); }
+lval* builtin_gt(lenv* e, lval* a) { return builtin_cmp(a, ">"); }
+lval* builtin_le(lenv* e, lval* a) { return builtin_cmp(a, "<="); }
+lval* builtin_ge(lenv* e, lval* a) { return builtin_cmp(a, ">="); }
+lval* builtin_eq(lenv* e, lval* a) { return builtin_cmp(a, "=="); }
+lval* builtin_ne(lenv* e, lval* a) { return builtin_cmp(a, "!="); }
+
+unsigned long lval_hash(lval* v);
+
+/* Hash of a value, equal for values that are == */
+lval* builtin_hash(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, "Function 'hash' passed incorrect number of arguments!");
+    lval* r = lval_long_num((long)lval_hash(a->cell[0]));
+    lval_del(a);
+    return r;
+}
+
+lval* lval_eval(lenv* e, lval* v);
+lval* lval_eval_code(lenv* e, lval* v, lval* hold);
+lval* lval_opt(lval* v);
+lval* lval_apply(lval* f, lval* a);
+int lval_truthy(lval* v);
+
+/* Walk over a sequence, computing each value only when it is asked for */
+typedef struct seq_iter {
+    lseq* s;
+    long i;
+    lval* x;
+    long skip;
+
+    /* Walk over the source of a stage */
+    struct seq_iter* sub;
+} seq_iter;
+
+void seq_iter_init(seq_iter* it, lseq* s) {
+    it->s = s;
+    it->i = s->start;
+    it->x = s->x && s->kind != SEQ_LIST ? lval_copy(s->x) : NULL;
+    it->skip = s->skip;
+    it->sub = NULL;
+    if (s->src) {
+        it->sub = malloc(sizeof(seq_iter));
+        seq_iter_init(it->sub, s->src->seq);
+    }
+}
+
+void seq_iter_free(seq_iter* it) {
+    if (it->x) { lval_del(it->x); }
+    if (it->sub) {
+        seq_iter_free(it->sub);
+        free(it->sub);
+    }
+}
+
+lval* seq_iter_next(seq_iter* it);
+
+/* The next value of a map or filter stage */
+lval* seq_iter_stage(seq_iter* it) {
+    lval* y;
+    while ((y = seq_iter_next(it->sub))) {
+        if (y->type == LVAL_ERR) { return y; }
+        if (it->s->kind == SEQ_MAP) { return lval_apply(it->s->f, lval_add(lval_sexpr(), y)); }
+
+        lval* keep = lval_apply(it->s->f, lval_add(lval_sexpr(), lval_copy(y)));
+        if (keep->type == LVAL_ERR) {
+            lval_del(y);
+            return keep;
+        }
+        int truthy = lval_truthy(keep);
+        lval_del(keep);
+        if (truthy && it->skip == 0) { return y; }
+        if (truthy) { it->skip--; }
+        lval_del(y);
+    }
+    return NULL;
+}
+
+/* The next value of the sequence, NULL past its end, or an error */
+lval* seq_iter_next(seq_iter* it) {
+    lseq* s = it->s;
+    if (--fuel_left < 0) {
+        lval* err = fuel_out();
+        if (err) { return err; }
+    }
+
+    if (s->kind == SEQ_MAP || s->kind == SEQ_FILTER) { return seq_iter_stage(it); }
+
+    if (s->kind == SEQ_LIST) {
+        if (it->i >= s->x->count) { return NULL; }
+        return lval_copy(s->x->cell[it->i++]);
+    }
+
+    if (s->kind == SEQ_RANGE) {
+        if (s->step > 0 ? it->i >= s->end : it->i <= s->end) { return NULL; }
+        lval* v = lval_long_num(it->i);
+
+        /* A step past the largest or smallest number is past the end */
+        if (__builtin_add_overflow(it->i, s->step, &it->i)) { it->i = s->end; }
+        return v;
+    }
+
+    if (s->kind == SEQ_ITERATE) {
+        for (; it->skip > 0; it->skip--) {
+            it->x = lval_apply(s->f, lval_add(lval_sexpr(), it->x));
+            if (it->x->type == LVAL_ERR) {
+                lval* err = it->x;
+                it->x = NULL;
+                return err;
+            }
+        }
+        it->skip = 1;
+        return lval_copy(it->x);
+    }
+
+    /* A generator's function gives {value next-state}, or {} when done */
+    while (it->x) {
+        lval* r = lval_apply(s->f, lval_add(lval_sexpr(), it->x));
+        it->x = NULL;
+        if (r->type == LVAL_ERR) { return r; }
+        if (r->type != LVAL_QEXPR || (r->count != 0 && r->count != 2)) {
+            lval_del(r);
+            return lval_err("Function 'generate' needs {value state} or {}!");
+        }
+        if (r->count == 0) {
+            lval_del(r);
+            return NULL;
+        }
+        it->x = lval_pop(r, 1);
+        lval* v = lval_take(r, 0);
+        if (it->skip == 0) { return v; }
+        it->skip--;
+        lval_del(v);
+    }
+    return NULL;
+}
+
+/* Value "n" of range "s" in "x", 0 when that is past its end, also when
+   it is past the largest or smallest number */
+int range_at(lseq* s, long n, long* x) {
+    if (__builtin_mul_overflow(n, s->step, x) || __builtin_add_overflow(s->start, *x, x)) { return 0; }
+    return s->step > 0 ? *x < s->end : *x > s->end;
+}
+
+/* The same sequence with its first "n" values dropped */
+lval* lval_seq_drop(lseq* s, long n) {
+    lval* v = lval_seq(s->kind);
+    lseq* d = v->seq;
+    d->start = s->start;
+    d->end = s->end;
+    d->step = s->step;
+    d->f = s->f ? lval_copy(s->f) : NULL;
+    d->x = s->x ? lval_copy(s->x) : NULL;
+    d->skip = s->skip;
+
+    /* Dropped values of a map need not be computed at all */
+    switch (s->kind) {
+        case SEQ_RANGE:
+            if (!range_at(s, n, &d->start)) { d->start = s->end; }
+            break;
+        case SEQ_LIST:
+            if (__builtin_add_overflow(s->start, n, &d->start) || d->start > s->x->count) { d->start = s->x->count; }
+            break;
+        case SEQ_MAP: d->src = lval_seq_drop(s->src->seq, n); break;
+        default:
+            if (__builtin_add_overflow(s->skip, n, &d->skip)) { d->skip = LONG_MAX; }
+            if (s->src) { d->src = lval_copy(s->src); }
+            break;
+    }
+    return v;
+}
+
+/* Whether a range or list sequence has no values left */
+int lval_seq_empty(lseq* s) {
+    if (s->kind == SEQ_LIST) { return s->start >= s->x->count; }
+    return s->step > 0 ? s->start >= s->end : s->start <= s->end;
+}
+
+/* Sequence viewing the values of list "x", consumes it */
+lval* lval_seq_list(lval* x) {
+    lval* v = lval_seq(SEQ_LIST);
+    v->seq->x = x;
+    return v;
+}
+
+/* Fold arithmetic "op" over the numbers of sequence "s", consumes it */
+lval* lval_reduce(lval* s, char* op) {
+    seq_iter it;
+    seq_iter_init(&it, s->seq);
+    lval* x = NULL;
+    long n = 0;
+
+    lval* y;
+    while ((y = seq_iter_next(&it))) {
+        if (y->type == LVAL_ERR) {
+            if (x) { lval_del(x); }
+            x = y;
+            break;
+        }
+        if (y->type != LVAL_NUM) {
+            lval_del(y);
+            if (x) { lval_del(x); }
+            x = lval_err("Cannot operate on non-number!");
+            break;
+        }
+        n++;
+        x = x ? lval_op(x, y, op) : y;
+        if (x->type == LVAL_ERR) { break; }
+    }
+    seq_iter_free(&it);
+    lval_del(s);
+
+    if (!x) {
+        if (strcmp(op, "+") == 0) { return lval_long_num(0); }
+        if (strcmp(op, "*") == 0) { return lval_long_num(1); }
+        return lval_err("Function '%s' passed an empty sequence!", op);
+    }
+
+    /* As with a single argument, a single value is negated */
+    if (n == 1 && x->type == LVAL_NUM && strcmp(op, "-") == 0) {
+        if (x->num_type == LVAL_LONG){ x->num->long_num = -x->num->long_num; }
+        if (x->num_type == LVAL_DOUBLE){ x->num->double_num = -x->num->double_num; }
+    }
+    return x;
+}
+
+int lval_is_long(lval* v) {
+    return v->type == LVAL_NUM && v->num_type == LVAL_LONG;
+}
+
+/* (range end), (range start end) or (range start end step): the numbers
+   from start up to but not including end, never held all at once */
+lval* builtin_range(lenv* e, lval* a) {
+    LASSERT(a, a->count >= 1 && a->count <= 3, "Function 'range' passed incorrect number of arguments!");
+    for (int i = 0; i < a->count; i++) {
+        LASSERT(a, lval_is_long(a->cell[i]), "Function 'range' passed incorrect type!");
+    }
+
+    lval* v = lval_seq(SEQ_RANGE);
+    lseq* s = v->seq;
+    s->step = 1;
+    if (a->count == 1) {
+        s->end = a->cell[0]->num->long_num;
+    } else {
+        s->start = a->cell[0]->num->long_num;
+        s->end = a->cell[1]->num->long_num;
+        if (a->count == 3) { s->step = a->cell[2]->num->long_num; }
+    }
+    lval_del(a);
+    if (s->step == 0) {
+        lval_del(v);
+        return lval_err("Function 'range' passed a step of 0!");
+    }
+    return v;
+}
+
+lval* builtin_seq_fn(lval* a, int kind, char* name) {
+    if (a->count != 2) {
+        lval_del(a);
+        return lval_err("Function '%s' passed incorrect number of arguments!", name);
+    }
+    if (a->cell[0]->type != LVAL_FUN) {
+        lval_del(a);
+        return lval_err("Function '%s' passed incorrect type!", name);
+    }
+
+    lval* v = lval_seq(kind);
+    v->seq->f = lval_pop(a, 0);
+    v->seq->x = lval_take(a, 0);
+    return v;
+}
+
+/* (iterate f x) is x, (f x), (f (f x)) and on without end */
+lval* builtin_iterate(lenv* e, lval* a) { return builtin_seq_fn(a, SEQ_ITERATE, "iterate"); }
+
+/* (generate f state) gives the values of (f state), which answers
+   {value next-state} to go on or {} to stop */
+lval* builtin_generate(lenv* e, lval* a) { return builtin_seq_fn(a, SEQ_GENERATE, "generate"); }
+
+/* The first "n" values of a list or sequence, as a list */
+lval* builtin_take(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2, "Function 'take' passed incorrect number of arguments!");
+    LASSERT(a, lval_is_long(a->cell[0]), "Function 'take' passed incorrect type!");
+    LASSERT(a, a->cell[1]->type == LVAL_QEXPR || a->cell[1]->type == LVAL_SEQ,
+            "Function 'take' passed incorrect type!");
+
+    long n = a->cell[0]->num->long_num;
+    lval* v = lval_take(a, 1);
+    if (v->type == LVAL_QEXPR) {
+        if (n < 0) { n = 0; }
+        if (n >= v->count) { return v; }
+        lval_uncache(v);
+        for (int i = n; i < v->count; i++) { lval_del(v->cell[i]); }
+        v->count = n;
+        v->cell = cells_resize(v->cell, v->count);
+        return v;
+    }
+
+    lval* r = lval_qexpr();
+    seq_iter it;
+    seq_iter_init(&it, v->seq);
+    for (long i = 0; i < n; i++) {
+        lval* x = seq_iter_next(&it);
+        if (!x) { break; }
+        if (x->type == LVAL_ERR) {
+            lval_del(r);
+            r = x;
+            break;
+        }
+        lval_add(r, x);
+    }
+    seq_iter_free(&it);
+    lval_del(v);
+    return r;
+}
+
+/* The value at index "n" of a list or sequence, counting from 0. Like
+   take it is given the index first: (nth n xs) */
+lval* builtin_nth(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2, "Function 'nth' passed incorrect number of arguments!");
+    LASSERT(a, lval_is_long(a->cell[0]), "Function 'nth' passed incorrect type!");
+    LASSERT(a, a->cell[1]->type == LVAL_QEXPR || a->cell[1]->type == LVAL_SEQ,
+            "Function 'nth' passed incorrect type!");
+
+    long n = a->cell[0]->num->long_num;
+    lval* v = a->cell[1];
+    LASSERT(a, n >= 0 && (v->type != LVAL_QEXPR || n < v->count),
+            "Function 'nth' passed an index out of range!");
+
+    if (v->type == LVAL_QEXPR) {
+        lval* x = lval_pop(v, n);
+        lval_del(a);
+        return x;
+    }
+
+    /* A range's values are counted, not stepped through */
+    lseq* s = v->seq;
+    if (s->kind == SEQ_RANGE) {
+        long x;
+        int past = !range_at(s, n, &x);
+        lval_del(a);
+        if (past) { return lval_err("Function 'nth' passed an index out of range!"); }
+        return lval_long_num(x);
+    }
+
+    if (s->kind == SEQ_LIST) {
+        lval* x = n < s->x->count - s->start ? lval_copy(s->x->cell[s->start + n]) : NULL;
+        lval_del(a);
+        return x ? x : lval_err("Function 'nth' passed an index out of range!");
+    }
+
+    lval* d = lval_seq_drop(s, n);
+    lval_del(a);
+    seq_iter it;
+    seq_iter_init(&it, d->seq);
+    lval* x = seq_iter_next(&it);
+    seq_iter_free(&it);
+    lval_del(d);
+    return x ? x : lval_err("Function 'nth' passed an index out of range!");
+}
+
+/* (seq xs) views list "xs" as a sequence, sequences are left as they are */
+lval* builtin_seq(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, "Function 'seq' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_QEXPR || a->cell[0]->type == LVAL_SEQ,
+            "Function 'seq' passed incorrect type!");
+
+    lval* x = lval_take(a, 0);
+    return x->type == LVAL_SEQ ? x : lval_seq_list(x);
+}
+
+/* (map f xs) and (filter p xs). On a list the new list is made in one
+   pass. On a sequence nothing is done yet: the result is a stage which
+   applies "f" to each value as it is asked for, so a chain of stages runs
+   as a single pass without any list in between */
+lval* builtin_stage(lval* a, int kind, char* name) {
+    if (a->count != 2) {
+        lval_del(a);
+        return lval_err("Function '%s' passed incorrect number of arguments!", name);
+    }
+    if (a->cell[0]->type != LVAL_FUN || (a->cell[1]->type != LVAL_QEXPR && a->cell[1]->type != LVAL_SEQ)) {
+        lval_del(a);
+        return lval_err("Function '%s' passed incorrect type!", name);
+    }
+
+    lval* v = lval_seq(kind);
+    v->seq->f = lval_pop(a, 0);
+    lval* src = lval_take(a, 0);
+    if (src->type == LVAL_SEQ) {
+        v->seq->src = src;
+        return v;
+    }
+
+    v->seq->src = lval_seq_list(src);
+    lval* r = lval_qexpr();
+    seq_iter it;
+    seq_iter_init(&it, v->seq);
+    lval* x;
+    while ((x = seq_iter_next(&it))) {
+        if (x->type == LVAL_ERR) {
+            lval_del(r);
+            r = x;
+            break;
+        }
+        lval_add(r, x);
+    }
+    seq_iter_free(&it);
+    lval_del(v);
+    return r;
+}
+
+lval* builtin_map(lenv* e, lval* a) { return builtin_stage(a, SEQ_MAP, "map"); }
+lval* builtin_filter(lenv* e, lval* a) { return builtin_stage(a, SEQ_FILTER, "filter"); }
+
+/* Name of the arithmetic builtin "f", or NULL */
+char* lval_arith_name(lval* f) {
+    if (f->builtin == builtin_add) { return "+"; }
+    if (f->builtin == builtin_sub) { return "-"; }
+    if (f->builtin == builtin_mul) { return "*"; }
+    if (f->builtin == builtin_div) { return "/"; }
+    if (f->builtin == builtin_mod) { return "%"; }
+    return NULL;
+}
+
+/* (f acc y), consumes "acc" and "y". Arithmetic builtins are done
+   directly rather than through a call */
+lval* lval_combine(lval* f, lval* acc, lval* y) {
+    char* op = lval_arith_name(f);
+    if (!op) { return lval_apply(f, lval_add(lval_add(lval_sexpr(), acc), y)); }
+    if (acc->type != LVAL_NUM || y->type != LVAL_NUM) {
+        lval_del(acc); lval_del(y);
+        return lval_err("Cannot operate on non-number!");
+    }
+    return lval_op(acc, y, op);
+}
+
+/* Fold "f" over what is left of "it", starting from "acc" */
+lval* lval_fold(lval* f, lval* acc, seq_iter* it) {
+    lval* y;
+    while ((y = seq_iter_next(it))) {
+        if (y->type == LVAL_ERR) {
+            lval_del(acc);
+            return y;
+        }
+        acc = lval_combine(f, acc, y);
+        if (acc->type == LVAL_ERR) { return acc; }
+    }
+    return acc;
+}
+
+/* (fold f init xs) and (reduce f xs), which starts from the first value */
+lval* builtin_fold(lenv* e, lval* a) {
+    LASSERT(a, a->count == 3, "Function 'fold' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_FUN, "Function 'fold' passed incorrect type!");
+    LASSERT(a, a->cell[2]->type == LVAL_QEXPR || a->cell[2]->type == LVAL_SEQ,
+            "Function 'fold' passed incorrect type!");
+
+    lval* xs = lval_pop(a, 2);
+    if (xs->type == LVAL_QEXPR) { xs = lval_seq_list(xs); }
+    seq_iter it;
+    seq_iter_init(&it, xs->seq);
+    lval* r = lval_fold(a->cell[0], lval_pop(a, 1), &it);
+    seq_iter_free(&it);
+    lval_del(xs);
+    lval_del(a);
+    return r;
+}
+
+lval* builtin_reduce(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2, "Function 'reduce' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_FUN, "Function 'reduce' passed incorrect type!");
+    LASSERT(a, a->cell[1]->type == LVAL_QEXPR || a->cell[1]->type == LVAL_SEQ,
+            "Function 'reduce' passed incorrect type!");
+
+    lval* xs = lval_pop(a, 1);
+    if (xs->type == LVAL_QEXPR) { xs = lval_seq_list(xs); }
+    seq_iter it;
+    seq_iter_init(&it, xs->seq);
+    lval* r = seq_iter_next(&it);
+    if (!r) {
+        r = lval_err("Function 'reduce' passed {}!");
+    } else if (r->type != LVAL_ERR) {
+        r = lval_fold(a->cell[0], r, &it);
+    }
+    seq_iter_free(&it);
+    lval_del(xs);
+    lval_del(a);
+    return r;
+}
+
+lval* builtin_head(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1,"Function 'head' passed too many arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_QEXPR || a->cell[0]->type == LVAL_SEQ,
+            "Function 'head' passed incorrect type!");
+
+    /* Of a sequence only the first value is computed */
+    if (a->cell[0]->type == LVAL_SEQ) {
+        seq_iter it;
+        seq_iter_init(&it, a->cell[0]->seq);
+        lval* x = seq_iter_next(&it);
+        seq_iter_free(&it);
+        lval_del(a);
+        if (!x) { return lval_err("Function 'head' passed {}!"); }
+        if (x->type == LVAL_ERR) { return x; }
+        return lval_add(lval_qexpr(), x);
+    }
+    LASSERT(a, a->cell[0]->count != 0,"Function 'head' passed {}!");
+
+    /* Otherwise take first argument */
+    lval* v = lval_take(a, 0);
+
+    /* Delete all elements that are not head and return */
+    while (v->count > 1) {
+        lval_del(lval_pop(v, 1));
+    }
+    return v;
+}
+
+lval* builtin_tail(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1,"Function 'tail' passed too many arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_QEXPR || a->cell[0]->type == LVAL_SEQ,
+            "Function 'tail' passed incorrect type!");
+
+    /* The tail of a sequence is another sequence, nothing is computed */
+    if (a->cell[0]->type == LVAL_SEQ) {
+        lseq* s = a->cell[0]->seq;
+        LASSERT(a, (s->kind != SEQ_RANGE && s->kind != SEQ_LIST) || !lval_seq_empty(s),
+                "Function 'tail' passed {}!");
+        lval* v = lval_seq_drop(s, 1);
+        lval_del(a);
+        return v;
+    }
+    LASSERT(a, a->cell[0]->count != 0,"Function 'tail' passed {}!");
+
+    /* Take first argument */
+    lval* v = lval_take(a, 0);
+
+    /* Delete first element and return */
+    lval_del(lval_pop(v, 0));
+    return v;
+}
+
+lval* builtin_list(lenv* e, lval* a) {
+    a->type = LVAL_QEXPR;
     return a;
 }
 
-lval* builtin_eval(lval* a) {
-    LASSERT(a, a->count == 1,"Function 'eval' passed too many arguments!");
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,"Function 'eval' passed incorrect type!");
+lval* lval_eval_q(lenv* e, lval* q);
+
+lval* builtin_eval(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1,"Function 'eval' passed too many arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,"Function 'eval' passed incorrect type!");
+
+    lval* x = lval_take(a, 0);
+    lval_uncache(x);
+    return lval_eval_q(e, x);
+}
+
+lval* lval_join(lval* x, lval* y) {
+
+    /* For each cell in 'y' add it to 'x' */
+    while (y->count) {
+        x = lval_add(x, lval_pop(y, 0));
+    }
+
+    /* Delete the empty 'y' and return 'x' */
+    lval_del(y);
+    return x;
+}
+
+lval* builtin_join(lenv* e, lval* a) {
+
+    for (int i = 0; i < a->count; i++) {
+        LASSERT(a, a->cell[i]->type == LVAL_QEXPR,"Function 'join' passed incorrect type.");
+    }
+
+    lval* x = lval_pop(a, 0);
+
+    while (a->count) {
+        x = lval_join(x, lval_pop(a, 0));
+    }
+
+    lval_del(a);
+    return x;
+}
+
+int arith_sym(char* sym) {
+    return strcmp(sym, "+") == 0 || strcmp(sym, "-") == 0 || strcmp(sym, "*") == 0
+        || strcmp(sym, "/") == 0 || strcmp(sym, "%") == 0;
+}
+
+
+/* Variables. Globals are looked up by interned name in a hash table.
+   When a lambda is made, every symbol in its body naming one of its
+   formals, or a formal of a lambda around it, is resolved to the
+   variable's address. Closures are flat: a lambda copies the variables
+   it uses from around it into a block of its own when it is made, so a
+   variable is either in the frame of the call or in that block */
+
+enum { FORM_NONE, FORM_LAMBDA, FORM_LET, FORM_BINDINGS };
+
+/* Every "step"th cell of "names" is a symbol */
+int lval_names_ok(lval* names, int step) {
+    for (int i = 0; i < names->count; i += step) {
+        if (names->cell[i]->type != LVAL_SYM) { return 0; }
+    }
+    return 1;
+}
+
+int is_special(char* sym) {
+    return sym == sym_let || sym == sym_cond || sym == sym_if || sym == sym_and || sym == sym_or;
+}
+
+/* Whether "v" is an S-expression headed by the unshadowed name "sym" */
+int lval_is_form(lval* v, char* sym) {
+    return v->type == LVAL_SEXPR && v->count > 0 && v->cell[0]->type == LVAL_SYM
+        && v->cell[0]->sym == sym && v->cell[0]->depth < 0;
+}
+
+int lval_is_let(lval* v) { return lval_is_form(v, sym_let); }
+
+/* Special forms evaluate their arguments only as far as needed: "if" its
+   condition and then one branch, "and" and "or" from left to right until
+   the outcome is known */
+enum { SPECIAL_NONE, SPECIAL_IF, SPECIAL_AND, SPECIAL_OR };
+
+int lval_special(lval* v) {
+    if (lval_is_form(v, sym_if)) { return SPECIAL_IF; }
+    if (lval_is_form(v, sym_and)) { return SPECIAL_AND; }
+    if (lval_is_form(v, sym_or)) { return SPECIAL_OR; }
+    return SPECIAL_NONE;
+}
+
+/* The value of special form "v" when it needs no evaluating, its error
+   when it is malformed, or NULL */
+lval* lval_special_start(lval* v, int special) {
+    if (special == SPECIAL_IF && v->count != 3 && v->count != 4) {
+        return lval_err("Function 'if' passed incorrect number of arguments!");
+    }
+    if (v->count == 1) { return lval_long_num(special == SPECIAL_AND); }
+    return NULL;
+}
+
+/* Zero and empty expressions are false, everything else is true */
+int lval_truthy(lval* v) {
+    switch (v->type) {
+        case LVAL_NUM: return !lval_is_zero(v);
+        case LVAL_SEXPR:
+        case LVAL_QEXPR: return v->count > 0;
+    }
+    return 1;
+}
+
+/* Lambdas and lets written out in code open a scope for their body */
+int lval_form(lval* v) {
+    if ((v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) || v->count != 3) { return FORM_NONE; }
+    lval* f = v->cell[0];
+    lval* names = v->cell[1];
+    if (f->type != LVAL_SYM || f->depth >= 0) { return FORM_NONE; }
+    if (names->type != LVAL_QEXPR || v->cell[2]->type != LVAL_QEXPR) { return FORM_NONE; }
+
+    if (f->sym == sym_lambda && lval_names_ok(names, 1)) { return FORM_LAMBDA; }
+    if (f->sym == sym_let && names->count % 2 == 0 && lval_names_ok(names, 2)) { return FORM_LET; }
+    return FORM_NONE;
+}
+
+/* Index of "sym" among the variables of "s": its names, then the
+   variables it captures. -1 when it has neither */
+int lscope_find(lscope* s, char* sym) {
+    for (int i = 0; i < s->count; i++) {
+        if (s->names[i] == sym) { return i; }
+    }
+    for (int j = 0; j < s->ncaptures; j++) {
+        if (s->captures[j] == sym) { return s->count + j; }
+    }
+    return -1;
+}
+
+int lscope_capture(lscope* s, char* sym) {
+    s->captures = realloc(s->captures, sizeof(char*) * (s->ncaptures + 1));
+    s->captures[s->ncaptures] = sym;
+    return s->ncaptures++;
+}
+
+/* Resolve the use of "x" in "scope". Its own names are at depth 0 and
+   everything else it sees is copied in when its lambda is made, so it is
+   at depth 1 among the captured variables. A variable of a scope further
+   out is captured by every scope in between, unless one of them belongs
+   to a lambda already made, then it can only be a global */
+void lval_resolve_sym(lval* x, lscope* scope) {
+    x->depth = -1;
+    x->slot = 0;
+
+    lscope* p = scope;
+    int i = -1;
+    for (; p; p = p->parent) {
+        if ((i = lscope_find(p, x->sym)) >= 0) { break; }
+    }
+    if (!p) { return; }
+
+    if (p == scope) {
+        x->depth = i < scope->count ? 0 : 1;
+        x->slot = i < scope->count ? i : i - scope->count;
+        return;
+    }
+
+    for (lscope* s = scope; s != p; s = s->parent) {
+        if (s->fixed) { return; }
+    }
+    x->depth = 1;
+    x->slot = lscope_capture(scope, x->sym);
+    for (lscope* s = scope->parent; s != p; s = s->parent) { lscope_capture(s, x->sym); }
+}
+
+typedef struct resolve_frame {
+    lval* v;
+    int i;
+    int form;
+    lscope* scope;
+
+    /* Scope opened for this list, released when it is done */
+    lscope* owned;
+} resolve_frame;
+
+/* Resolve the symbols of code "v" that name variables of "scope" or of a
+   scope around it. Q-expressions are resolved too, as they may be code
+   for "eval". Formals and let names are names, not uses, and are skipped */
+void lval_resolve(lval* v, lscope* scope) {
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+        if (v->type == LVAL_SYM) { lval_resolve_sym(v, scope); }
+        return;
+    }
+
+    int top = 0;
+    int cap = 16;
+    resolve_frame* stack = malloc(sizeof(resolve_frame) * cap);
+    stack[0] = (resolve_frame){ v, 0, lval_form(v), scope, NULL };
+
+    while (top >= 0) {
+        resolve_frame* f = &stack[top];
+
+        /* Code compiled before it was resolved is out of date */
+        if (f->i == 0) { lval_uncache(f->v); }
+
+        if (f->i == f->v->count) {
+            lscope_release(f->owned);
+            top--;
+            continue;
+        }
+
+        int i = f->i++;
+        lval* x = f->v->cell[i];
+        lscope* s = f->scope;
+        int form = FORM_NONE;
+
+        if (f->form == FORM_LAMBDA && i == 1) { continue; }
+        if (f->form == FORM_BINDINGS && i % 2 == 0) { continue; }
+
+        if (x->type == LVAL_SYM) {
+            lval_resolve_sym(x, s);
+            continue;
+        }
+        if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { continue; }
+
+        if (f->form == FORM_LET && i == 1) {
+            form = FORM_BINDINGS;
+        } else {
+            form = lval_form(x);
+        }
+
+        if (++top == cap) {
+            cap *= 2;
+            stack = realloc(stack, sizeof(resolve_frame) * cap);
+        }
+        f = &stack[top - 1];
+        stack[top] = (resolve_frame){ x, 0, form, s, NULL };
+
+        /* The body of a lambda or let is in a scope of its own */
+        if (i == 2 && (f->form == FORM_LAMBDA || (f->form == FORM_LET && f->v->cell[1]->count))) {
+            lscope* inner = lscope_new(f->v->cell[1], f->form == FORM_LET ? 2 : 1, s);
+            stack[top].scope = stack[top].owned = inner;
+        }
+    }
+
+    free(stack);
+}
+
+/* Make a lambda of "formals" and "body" written inside the scope
+   "scope", or at top level when it is NULL. The body is resolved and
+   optimized here, once, and shared by every call. The lambda made is
+   not closed over anything yet, see lval_close */
+lval* lval_lambda(lval* formals, lval* body, lscope* scope) {
+    if (!lval_names_ok(formals, 1)) {
+        lval_del(formals); lval_del(body);
+        return lval_err("Cannot define non-symbol!");
+    }
+
+    lproto* p = malloc(sizeof(lproto));
+    p->refs = 1;
+    p->scope = lscope_new(formals, 1, scope);
+    p->code = NULL;
+    lval_del(formals);
+
+    body->type = LVAL_SEXPR;
+    lval_resolve(body, p->scope);
+    p->scope->fixed = 1;
+
+    /* Where each captured variable is found when the lambda is made */
+    p->from = lval_qexpr();
+    for (int j = 0; j < p->scope->ncaptures; j++) {
+        lval* s = lval_sym(p->scope->captures[j]);
+        if (scope) { lval_resolve_sym(s, scope); }
+        lval_add(p->from, s);
+    }
+    p->captures = lscope_new(p->from, 1, NULL);
+    p->body = lval_opt(body);
+
+    lval* v = lval_builtin(NULL);
+    v->proto = p;
+    return v;
+}
+
+/* Close lambda "p" over frame "e": the variables it captures are copied
+   out of the frame into a block which its calls see as their parent */
+lval* lval_close(lproto* p, lenv* e) {
+    lval* f = lval_builtin(NULL);
+    f->proto = p;
+    ref_inc(&p->refs);
+    if (p->captures->count) {
+        lenv* b = lenv_new(p->captures, NULL);
+        for (int j = 0; j < p->captures->count; j++) { b->slots[j] = lenv_get(e, p->from->cell[j]); }
+        f->env = b;
+    }
+    return f;
+}
+
+/* The lambda written out as "form", closed over frame "e". It is made on
+   first use and kept on the form for as long as the form runs in frames
+   of the same scope. Threads take turns with the code made on first use */
+pthread_mutex_t code_lock = PTHREAD_MUTEX_INITIALIZER;
+
+lval* lval_closure(lval* form, lenv* e) {
+    lscope* scope = e ? e->scope : NULL;
+
+    if (threaded) { pthread_mutex_lock(&code_lock); }
+    lval* r = NULL;
+    if (!form->proto || form->proto->scope->parent != scope) {
+        lval* f = lval_lambda(lval_copy(form->cell[1]), lval_copy(form->cell[2]), scope);
+        if (f->type != LVAL_FUN) {
+            r = f;
+        } else {
+            if (form->proto) { lproto_release(form->proto); }
+            form->proto = f->proto;
+            ref_inc(&form->proto->refs);
+            lval_del(f);
+        }
+    }
+    if (!r) { r = lval_close(form->proto, e); }
+    if (threaded) { pthread_mutex_unlock(&code_lock); }
+    return r;
+}
+
+lval* builtin_lambda(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2, "Function '\\' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_QEXPR && a->cell[1]->type == LVAL_QEXPR,
+            "Function '\\' passed incorrect type!");
+
+    lval* formals = lval_pop(a, 0);
+    lval* f = lval_lambda(formals, lval_take(a, 0), e ? e->scope : NULL);
+    if (f->type != LVAL_FUN) { return f; }
+    lval* r = lval_close(f->proto, e);
+    lval_del(f);
+    return r;
+}
+
+/* (let {x 1 y 2} {body}) stands for ((\ {x y} {body}) 1 2): the values
+   are evaluated where the let is and the body in a frame of its own */
+lval* lval_let(lval* v) {
+    LASSERT(v, v->count == 3, "Function 'let' passed incorrect number of arguments!");
+    LASSERT(v, v->cell[1]->type == LVAL_QEXPR && v->cell[2]->type == LVAL_QEXPR,
+            "Function 'let' passed incorrect type!");
+    LASSERT(v, v->cell[1]->count % 2 == 0, "Function 'let' passed a name without a value!");
+    LASSERT(v, lval_names_ok(v->cell[1], 2), "Cannot define non-symbol!");
+
+    lval* binds = lval_pop(v, 1);
+    lval* body = lval_take(v, 1);
+    lval* call = lval_sexpr();
+
+    /* Without bindings there is no frame to make */
+    if (binds->count == 0) {
+        lval_del(binds);
+        lval_add(call, lval_sym(sym_eval));
+        return lval_add(call, body);
+    }
+
+    lval* formals = lval_qexpr();
+    lval* fn = lval_sexpr();
+    lval_add(call, fn);
+    while (binds->count) {
+        lval_add(formals, lval_pop(binds, 0));
+        lval_add(call, lval_pop(binds, 0));
+    }
+    lval_del(binds);
+
+    lval_add(fn, lval_sym(sym_lambda));
+    lval_add(fn, formals);
+    lval_add(fn, body);
+    return call;
+}
+
+/* (cond (t1 e1) (t2 e2)) stands for (if t1 e1 (if t2 e2 ())) */
+lval* lval_cond(lval* v) {
+    for (int i = 1; i < v->count; i++) {
+        LASSERT(v, v->cell[i]->type == LVAL_SEXPR && v->cell[i]->count == 2,
+                "Function 'cond' passed incorrect type!");
+    }
+
+    lval* r = lval_sexpr();
+    while (v->count > 1) {
+        lval* clause = lval_pop(v, v->count - 1);
+        lval* x = lval_sexpr();
+        lval_add(x, lval_sym(sym_if));
+        lval_add(x, lval_pop(clause, 0));
+        lval_add(x, lval_take(clause, 0));
+        r = lval_add(x, r);
+    }
+    lval_del(v);
+    return r;
+}
+
+/* Forms that stand for other code */
+int lval_is_sugar(lval* v) {
+    return lval_is_let(v) || lval_is_form(v, sym_cond);
+}
+
+lval* lval_desugar(lval* v) {
+    return lval_is_let(v) ? lval_let(v) : lval_cond(v);
+}
+
+lval* builtin_def(lenv* e, lval* a) {
+    LASSERT(a, a->count > 0 && a->cell[0]->type == LVAL_QEXPR, "Function 'def' passed incorrect type!");
+    lval* syms = a->cell[0];
+    LASSERT(a, lval_names_ok(syms, 1), "Function 'def' cannot define non-symbol!");
+    LASSERT(a, syms->count == a->count - 1, "Function 'def' passed incorrect number of values to symbols!");
+    LASSERT(a, !in_task, "Function 'def' cannot define from a parallel task!");
+
+    for (int i = 0; i < syms->count; i++) {
+        char* sym = syms->cell[i]->sym;
+        if (global_builtin(sym) || is_special(sym)) {
+            lval* err = lval_err("Cannot redefine builtin '%s'!", sym);
+            lval_del(a);
+            return err;
+        }
+    }
+
+    for (int i = 0; i < syms->count; i++) { global_put(syms->cell[i]->sym, lval_pop(a, 1)); }
+    lval_del(a);
+    return lval_sexpr();
+}
+
+void lenv_add_builtin(char* name, lbuiltin func) {
+    char* sym = intern(name);
+    global_put(sym, lval_builtin(func));
+    global_slot(sym)->fixed = 1;
+}
+
+lval* builtin_pmap(lenv* e, lval* a);
+lval* builtin_pfilter(lenv* e, lval* a);
+lval* builtin_preduce(lenv* e, lval* a);
+lval* builtin_future(lenv* e, lval* a);
+lval* builtin_await(lenv* e, lval* a);
+lval* builtin_spawn(lenv* e, lval* a);
+lval* builtin_chan(lenv* e, lval* a);
+lval* builtin_send(lenv* e, lval* a);
+lval* builtin_recv(lenv* e, lval* a);
+lval* builtin_actor(lenv* e, lval* a);
+lval* builtin_tell(lenv* e, lval* a);
+lval* builtin_receive(lenv* e, lval* a);
+lval* builtin_fuel(lenv* e, lval* a);
+lval* builtin_timeout(lenv* e, lval* a);
+lval* builtin_memo(lenv* e, lval* a);
+lval* builtin_memo_stats(lenv* e, lval* a);
+lval* builtin_hmap(lenv* e, lval* a);
+lval* builtin_hget(lenv* e, lval* a);
+lval* builtin_hset(lenv* e, lval* a);
+lval* builtin_hdel(lenv* e, lval* a);
+lval* builtin_hkeys(lenv* e, lval* a);
+
+void lenv_add_builtins(void) {
+    sym_eval = intern("eval");
+    sym_lambda = intern("\\");
+    sym_let = intern("let");
+    sym_cond = intern("cond");
+    sym_if = intern("if");
+    sym_and = intern("and");
+    sym_or = intern("or");
+
+    lenv_add_builtin("list", builtin_list);
+    lenv_add_builtin("head", builtin_head);
+    lenv_add_builtin("tail", builtin_tail);
+    lenv_add_builtin("join", builtin_join);
+    lenv_add_builtin("eval", builtin_eval);
+
+    lenv_add_builtin("+", builtin_add);
+    lenv_add_builtin("-", builtin_sub);
+    lenv_add_builtin("*", builtin_mul);
+    lenv_add_builtin("/", builtin_div);
+    lenv_add_builtin("%", builtin_mod);
+
+    lenv_add_builtin("<", builtin_lt);
+    lenv_add_builtin(">", builtin_gt);
+    lenv_add_builtin("<=", builtin_le);
+    lenv_add_builtin(">=", builtin_ge);
+    lenv_add_builtin("==", builtin_eq);
+    lenv_add_builtin("!=", builtin_ne);
+    lenv_add_builtin("hash", builtin_hash);
+
+    lenv_add_builtin("range", builtin_range);
+    lenv_add_builtin("iterate", builtin_iterate);
+    lenv_add_builtin("generate", builtin_generate);
+    lenv_add_builtin("take", builtin_take);
+    lenv_add_builtin("nth", builtin_nth);
+    lenv_add_builtin("seq", builtin_seq);
+    lenv_add_builtin("map", builtin_map);
+    lenv_add_builtin("filter", builtin_filter);
+    lenv_add_builtin("fold", builtin_fold);
+    lenv_add_builtin("reduce", builtin_reduce);
+    lenv_add_builtin("pmap", builtin_pmap);
+    lenv_add_builtin("pfilter", builtin_pfilter);
+    lenv_add_builtin("preduce", builtin_preduce);
+    lenv_add_builtin("future", builtin_future);
+    lenv_add_builtin("await", builtin_await);
+    lenv_add_builtin("spawn", builtin_spawn);
+    lenv_add_builtin("chan", builtin_chan);
+    lenv_add_builtin("send", builtin_send);
+    lenv_add_builtin("recv", builtin_recv);
+    lenv_add_builtin("actor", builtin_actor);
+    lenv_add_builtin("tell", builtin_tell);
+    lenv_add_builtin("receive", builtin_receive);
+    lenv_add_builtin("fuel", builtin_fuel);
+    lenv_add_builtin("timeout", builtin_timeout);
+    lenv_add_builtin("memo", builtin_memo);
+    lenv_add_builtin("memo-stats", builtin_memo_stats);
+    lenv_add_builtin("hmap", builtin_hmap);
+    lenv_add_builtin("hget", builtin_hget);
+    lenv_add_builtin("hset", builtin_hset);
+    lenv_add_builtin("hdel", builtin_hdel);
+    lenv_add_builtin("hkeys", builtin_hkeys);
+
+    lenv_add_builtin("def", builtin_def);
+    lenv_add_builtin("\\", builtin_lambda);
+}
+
+lval* memo_call(struct lmemo* m, lval* a);
+
+/* Call builtin "f" on the arguments "a" in frame "e". A memoized
+   function looks in its cache first */
+lval* builtin_call(lval* f, lenv* e, lval* a) {
+    return f->memo ? memo_call(f->memo, a) : f->builtin(e, a);
+}
+
+/* Apply an S-expression whose children are already evaluated, none of
+   them to an error. "eval" and
+   calls of lambdas are not evaluated from here: the expression to evaluate,
+   its frame and the value keeping the expression alive are handed back
+   through "tail", "tail_env" and "tail_hold" and evaluated in place of
+   "v", so they cost no extra stack. A lambda's body is evaluated where it
+   is, never copied */
+lval* lval_eval_sexpr(lenv* e, lval* v, lval** tail, lenv** tail_env, lval** tail_hold) {
+
+    /* Empty Expression */
+    if (v->count == 0) { return v; }
+
+    /* Single Expression */
+    if (v->count == 1) { return lval_take(v, 0); }
+
+    /* Ensure First Element is Function */
+    lval* f = lval_pop(v, 0);
+    if (f->type != LVAL_FUN) {
+        lval_del(f); lval_del(v);
+        return lval_err("S-expression Does not start with function!");
+    }
+
+    if (f->builtin == builtin_eval) {
+        lval_del(f);
+        LASSERT(v, v->count == 1,"Function 'eval' passed too many arguments!");
+        LASSERT(v, v->cell[0]->type == LVAL_QEXPR,"Function 'eval' passed incorrect type!");
+
+        lval* x = lval_take(v, 0);
+        lval_uncache(x);
+        x->type = LVAL_SEXPR;
+
+        /* What is left after optimizing may not need evaluating at all */
+        x = lval_opt(x);
+        if (x->type != LVAL_SEXPR) { return lval_eval(e, x); }
+        *tail = *tail_hold = x;
+        *tail_env = e;
+        if (e) { ref_inc(&e->refs); }
+        return NULL;
+    }
+
+    /* Call builtin with operator */
+    if (f->builtin) {
+        lval* result = builtin_call(f, e, v);
+        lval_del(f);
+        return result;
+    }
+
+    lproto* p = f->proto;
+    if (v->count != p->scope->count) {
+        lval* err = lval_err("Function passed %i arguments, expected %i!", v->count, p->scope->count);
+        lval_del(f); lval_del(v);
+        return err;
+    }
+
+    /* Arguments move into the slots of a new frame */
+    lenv* env = lenv_new(p->scope, f->env);
+    for (int i = 0; i < v->count; i++) { env->slots[i] = vval_from_lval(v->cell[i]); }
+    v->count = 0;
+    lval_del(v);
+
+    if (p->body->type != LVAL_SEXPR) {
+        lval* r = lval_eval(env, lval_copy(p->body));
+        lenv_release(env);
+        lval_del(f);
+        return r;
+    }
+    *tail = p->body;
+    *tail_env = env;
+    *tail_hold = f;
+    return NULL;
+}
+
+/* Parallel evaluation. With --parallel the big children of an
+   S-expression are handed as tasks to a pool of threads while the rest
+   are evaluated in order. Only code without effects can be a task: calls
+   of pure builtins, if, and, or, variables and literals. A task only reads
+   the code, the frames it runs in and the globals, none of which change
+   while any task is under way, so the values are the same as evaluating
+   in order. Each thread has a deque of tasks, pushing and popping its own
+   at the bottom; a thread with nothing to do steals from the top of
+   another's */
+
+int par_enabled = 0;
+
+/* Threads in the pool, 0 for one per core */
+long par_threads = 0;
+
+/* Children of a smaller size are not worth a task */
+long par_grain = 64;
+
+/* Tasks are evaluated recursively, code nested deeper is never one */
+#define PAR_MAX_DEPTH 512
+
+typedef struct ptask {
+    void (*run)(struct ptask* t);
+    lval* v;
+    lenv* e;
+    lval* result;
+
+    /* Elements handled by a task of a data-parallel builtin, and where
+       their values go */
+    lval** items;
+    lval** out;
+    int count;
+    atomic_int done;
+
+    /* Nobody joins the task, it is freed once run */
+    int detached;
+
+    /* Fuel the task runs on, that of its maker, and when it times out */
+    lfuel* fuel;
+    double deadline;
+} ptask;
+
+typedef struct pdeque {
+    pthread_mutex_t lock;
+    ptask** tasks;
+    int top;
+    int bottom;
+    int cap;
+} pdeque;
+
+pdeque* pool = NULL;
+int pool_size = 0;
+
+/* Tasks waiting in the deques, and tasks not yet finished */
+atomic_int pool_queued;
+atomic_int pool_running;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+
+/* Deque of the running thread, the main thread has the first */
+_Thread_local int pool_self = 0;
+
+/* Actors whose code is still running. One waiting in receive runs none,
+   and isn't counted meanwhile */
+atomic_int actors_running;
+
+/* Rewrites of compiled code the main code is in the middle of */
+atomic_int code_claimed;
+
+/* Whether this thread may rewrite compiled code and its caches: nothing
+   else can be running any while no task or actor is. When it may, it has
+   the code to itself until code_release, an actor that is done waiting
+   in receive holding off until then */
+int code_claim(void) {
+    if (!threaded) { return 1; }
+    if (in_task || atomic_load(&pool_running) > 0) { return 0; }
+    atomic_fetch_add(&code_claimed, 1);
+    if (atomic_load(&actors_running) == 0) { return 1; }
+    atomic_fetch_sub(&code_claimed, 1);
+    return 0;
+}
+
+void code_release(void) {
+    if (threaded) { atomic_fetch_sub(&code_claimed, 1); }
+}
+
+void pool_push(ptask* t) {
+    atomic_fetch_add(&pool_running, 1);
+    pdeque* d = &pool[pool_self];
+    pthread_mutex_lock(&d->lock);
+    if (d->top == d->bottom) { d->top = d->bottom = 0; }
+    if (d->bottom == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 64;
+        d->tasks = realloc(d->tasks, sizeof(ptask*) * d->cap);
+    }
+    d->tasks[d->bottom++] = t;
+    pthread_mutex_unlock(&d->lock);
+
+    pthread_mutex_lock(&pool_lock);
+    atomic_fetch_add(&pool_queued, 1);
+    pthread_cond_signal(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* A task to run: the newest of this thread's own, else the oldest of
+   another thread's, or NULL */
+ptask* pool_take(void) {
+    if (atomic_load(&pool_queued) == 0) { return NULL; }
+    for (int k = 0; k < pool_size; k++) {
+        pdeque* d = &pool[(pool_self + k) % pool_size];
+        ptask* t = NULL;
+        pthread_mutex_lock(&d->lock);
+        if (d->bottom > d->top) { t = k == 0 ? d->tasks[--d->bottom] : d->tasks[d->top++]; }
+        pthread_mutex_unlock(&d->lock);
+        if (t) {
+            atomic_fetch_sub(&pool_queued, 1);
+            return t;
+        }
+    }
+    return NULL;
+}
+
+void pool_run(ptask* t) {
+    lactor* self = actor_self;
+    lfuel* fuel = fuel_use(t->fuel);
+    double deadline = fuel_deadline;
+    actor_self = NULL;
+    fuel_deadline = t->deadline;
+    t->run(t);
+    actor_self = self;
+    lfuel_release(fuel_use(fuel));
+    fuel_deadline = deadline;
+    atomic_fetch_sub(&pool_running, 1);
+    if (t->detached) { free(t); } else { atomic_store(&t->done, 1); }
+}
+
+/* Run a waiting task while waiting for something, else let other threads
+   get on */
+void pool_help(void) {
+    ptask* u = pool_take();
+    if (u) { pool_run(u); } else { sched_yield(); }
+}
+
+void stack_init(void);
+
+void* pool_worker(void* arg) {
+    pool_self = (int)(long)arg;
+    stack_init();
+    while (1) {
+        ptask* t = pool_take();
+        if (t) {
+            pool_run(t);
+            continue;
+        }
+        pthread_mutex_lock(&pool_lock);
+        while (atomic_load(&pool_queued) == 0) { pthread_cond_wait(&pool_wake, &pool_lock); }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+
+/* Start the pool with "n" threads, the main thread among them */
+void pool_start(int n) {
+    threaded = 1;
+    pool_size = n;
+    pool = calloc(n, sizeof(pdeque));
+    for (int i = 0; i < n; i++) { pthread_mutex_init(&pool[i].lock, NULL); }
+    for (int i = 1; i < n; i++) {
+        pthread_t th;
+        pthread_create(&th, NULL, pool_worker, (void*)(long)i);
+        pthread_detach(th);
+    }
+}
+
+/* The pool, started on first use with the configured number of threads.
+   By default there is always a thread besides the main one, for futures
+   to run in the background */
+void pool_ensure(void) {
+    if (pool) { return; }
+    long n = par_threads ? par_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    pool_start(par_threads || n > 1 ? n : 2);
+}
+
+/* Task doing "run", for the caller to fill in and push */
+ptask* ptask_new(void (*run)(ptask* t)) {
+    ptask* t = malloc(sizeof(ptask));
+    t->run = run;
+    t->result = NULL;
+    t->detached = 0;
+    t->fuel = lfuel_copy(fuel_pool);
+    t->deadline = fuel_deadline;
+    atomic_init(&t->done, 0);
+    return t;
+}
+
+lval* par_eval(lenv* e, lval* v, int depth);
+
+void par_run(ptask* t) { t->result = par_eval(t->e, t->v, 0); }
+
+/* Start evaluating "v" in frame "e" on the pool */
+ptask* par_spawn(lval* v, lenv* e) {
+    ptask* t = ptask_new(par_run);
+    t->v = v;
+    t->e = e;
+    pool_push(t);
+    return t;
+}
+
+/* Wait for task "t", running other tasks meanwhile, and free it. Gives
+   its value, or NULL when it has to be evaluated in order instead */
+lval* par_join(ptask* t) {
+    while (!atomic_load(&t->done)) { pool_help(); }
+    lval* r = t->result;
+    free(t);
+    return r;
+}
+
+/* Wait for every task to finish, before evaluating what may have effects */
+void par_quiesce(void) {
+    while (atomic_load(&pool_running) > 0) { pool_help(); }
+}
+
+int is_pure_builtin(lval* f);
+
+/* Size of "v" as a task, or -1 when it can't be one. It is worked out
+   before any task sees the code and kept on each S-expression */
+int lval_weight(lval* v, int depth) {
+    if (v->type != LVAL_SEXPR) { return 1; }
+    if (v->weight) { return v->weight; }
+    if (depth > PAR_MAX_DEPTH) { return v->weight = -1; }
+
+    int safe = v->count < 2 || lval_special(v) || is_pure_builtin(v->cell[0]);
+    int w = 1;
+    for (int i = 0; i < v->count; i++) {
+        int c = lval_weight(v->cell[i], depth + 1);
+        if (c < 0) { safe = 0; } else { w += c; }
+    }
+    return v->weight = safe ? w : -1;
+}
+
+/* Whether "v" can be copied on any thread, holding nothing shared by
+   reference count */
+int lval_shareable(lval* v) {
+    switch (v->type) {
+        case LVAL_FUN: return !v->proto && !v->env && !v->memo;
+        case LVAL_SEQ:
+        case LVAL_FUTURE:
+        case LVAL_CHAN:
+        case LVAL_ACTOR:
+        case LVAL_HMAP: return 0;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (v->code || v->proto) { return 0; }
+            for (int i = 0; i < v->count; i++) {
+                if (!lval_shareable(v->cell[i])) { return 0; }
+            }
+            return 1;
+    }
+    return 1;
+}
+
+/* Value of symbol "s" for a task, NULL when it can't be copied there */
+lval* par_get(lenv* e, lval* s) {
+    vval* x = lenv_slot(e, s);
+    if (x && x->tag != VV_LVAL) { return vval_to_lval(*x); }
+    lval* v = x ? x->v : global_get(s->sym);
+    if (!v) { return lval_err("Unbound Symbol '%s'", s->sym); }
+    return lval_shareable(v) ? lval_copy(v) : NULL;
+}
+
+/* Tasks for the big children of "v" evaluated in frame "e", all but the
+   last, which the caller evaluates itself. NULL when there are none or
+   when any child can't be a task */
+ptask** par_split(lval* v, lenv* e) {
+    int last = -1;
+    for (int i = 0; i < v->count; i++) {
+        int w = lval_weight(v->cell[i], 0);
+        if (w < 0) { return NULL; }
+        if (w >= par_grain) { last = i; }
+    }
+
+    ptask** tasks = NULL;
+    for (int i = 0; i < last; i++) {
+        if (lval_weight(v->cell[i], 0) < par_grain) { continue; }
+        if (!tasks) { tasks = calloc(v->count, sizeof(ptask*)); }
+        tasks[i] = par_spawn(v->cell[i], e);
+    }
+    return tasks;
+}
+
+/* Evaluate "v", which can be a task, in frame "e". The same as lval_eval
+   but recursive and changing nothing it doesn't own. NULL when a value
+   it meets can't be copied on this thread */
+lval* par_eval(lenv* e, lval* v, int depth) {
+    if (v->type == LVAL_SYM) { return par_get(e, v); }
+    if (v->type != LVAL_SEXPR) { return lval_copy(v); }
+    if (v->count == 0) { return lval_sexpr(); }
+
+    int special = lval_special(v);
+    if (special) {
+        lval* r = lval_special_start(v, special);
+        if (r) { return r; }
+
+        if (special == SPECIAL_IF) {
+            lval* c = par_eval(e, v->cell[1], depth + 1);
+            if (!c || c->type == LVAL_ERR) { return c; }
+            int truthy = lval_truthy(c);
+            lval_del(c);
+            lval* branch = truthy ? v->cell[2] : v->count == 4 ? v->cell[3] : NULL;
+            return branch ? par_eval(e, branch, depth + 1) : lval_sexpr();
+        }
+
+        for (int i = 1; i < v->count; i++) {
+            lval* x = par_eval(e, v->cell[i], depth + 1);
+            if (!x || x->type == LVAL_ERR) { return x; }
+            if (i == v->count - 1 || lval_truthy(x) == (special == SPECIAL_OR)) { return x; }
+            lval_del(x);
+        }
+    }
+
+    /* Children in order; the first error, or the first that can't be
+       evaluated here, is what the whole comes to */
+    ptask** tasks = par_split(v, e);
+    lval* a = lval_sexpr();
+    a->cell = cells_resize(NULL, v->count);
+    lval* stop = NULL;
+    int stopped = 0;
+    for (int i = 0; i < v->count; i++) {
+        int spawned = tasks && tasks[i];
+        if (stopped && !spawned) { continue; }
+        lval* x = spawned ? par_join(tasks[i]) : par_eval(e, v->cell[i], depth + 1);
+        if (stopped) {
+            if (x) { lval_del(x); }
+        } else if (!x || x->type == LVAL_ERR) {
+            stopped = 1;
+            stop = x;
+        } else {
+            a->cell[a->count++] = x;
+        }
+    }
+    free(tasks);
+    if (stopped) {
+        lval_del(a);
+        return stop;
+    }
+
+    if (a->count == 1) { return lval_take(a, 0); }
+    lval* f = lval_pop(a, 0);
+    lval* r = builtin_call(f, e, a);
+    lval_del(f);
+    return r;
+}
+
+/* Data-parallel builtins. (pmap f xs), (pfilter p xs) and (preduce f xs)
+   cut the list into chunks, each a task for the pool. Every element's
+   value has a place of its own, so the result is put together in order
+   whichever thread computed it. How the list is cut depends only on its
+   length: preduce, which needs "f" to be associative, combines the same
+   values in the same order on any number of threads */
+enum { PDATA_MAP, PDATA_FILTER, PDATA_REDUCE };
+
+/* Most chunks a list is cut into */
+#define PDATA_CHUNKS 256
+
+/* Apply the function to each element of the chunk, up to an error */
+void pdata_apply(ptask* t) {
+    int was = in_task;
+    in_task = 1;
+    for (int i = 0; i < t->count; i++) {
+        t->out[i] = lval_apply(t->v, lval_add(lval_sexpr(), lval_copy(t->items[i])));
+        if (t->out[i]->type == LVAL_ERR) { break; }
+    }
+    in_task = was;
+}
+
+/* Reduce the chunk to its first slot */
+void pdata_reduce(ptask* t) {
+    int was = in_task;
+    in_task = 1;
+    lval* acc = lval_copy(t->items[0]);
+    for (int i = 1; i < t->count && acc->type != LVAL_ERR; i++) {
+        acc = lval_combine(t->v, acc, lval_copy(t->items[i]));
+    }
+    t->out[0] = acc;
+    in_task = was;
+}
+
+lval* builtin_pdata(lval* a, int kind, char* name) {
+    if (a->count != 2) {
+        lval_del(a);
+        return lval_err("Function '%s' passed incorrect number of arguments!", name);
+    }
+    if (a->cell[0]->type != LVAL_FUN || a->cell[1]->type != LVAL_QEXPR) {
+        lval_del(a);
+        return lval_err("Function '%s' passed incorrect type!", name);
+    }
+    LASSERT(a, kind != PDATA_REDUCE || a->cell[1]->count != 0, "Function 'preduce' passed {}!");
+
+    lval* f = lval_pop(a, 0);
+    lval* xs = lval_take(a, 0);
+    int n = xs->count;
+    int len = n > PDATA_CHUNKS ? (n + PDATA_CHUNKS - 1) / PDATA_CHUNKS : 1;
+    int ntasks = (n + len - 1) / len;
+
+    pool_ensure();
+    lval** out = calloc(n + 1, sizeof(lval*));
+    ptask** tasks = malloc(sizeof(ptask*) * (ntasks + 1));
+    for (int k = 0; k < ntasks; k++) {
+        ptask* t = ptask_new(kind == PDATA_REDUCE ? pdata_reduce : pdata_apply);
+        t->v = f;
+        t->items = &xs->cell[k * len];
+        t->out = &out[k * len];
+        t->count = n - k * len < len ? n - k * len : len;
+        pool_push(t);
+        tasks[k] = t;
+    }
+    for (int k = 0; k < ntasks; k++) { par_join(tasks[k]); }
+    free(tasks);
+
+    /* The first error in order is the result, the rest is dropped */
+    lval* r = kind == PDATA_REDUCE ? NULL : lval_qexpr();
+    int stopped = 0;
+    for (int i = 0; i < n; i += kind == PDATA_REDUCE ? len : 1) {
+        lval* x = out[i];
+        if (stopped) {
+            if (x) { lval_del(x); }
+        } else if (x->type == LVAL_ERR) {
+            if (r) { lval_del(r); }
+            r = x;
+            stopped = 1;
+        } else if (kind == PDATA_MAP) {
+            lval_add(r, x);
+        } else if (kind == PDATA_FILTER) {
+            if (lval_truthy(x)) { lval_add(r, lval_copy(xs->cell[i])); }
+            lval_del(x);
+        } else {
+            r = r ? lval_combine(f, r, x) : x;
+            stopped = r->type == LVAL_ERR;
+        }
+    }
+
+    free(out);
+    lval_del(f);
+    lval_del(xs);
+    return r;
+}
+
+lval* builtin_pmap(lenv* e, lval* a) { return builtin_pdata(a, PDATA_MAP, "pmap"); }
+lval* builtin_pfilter(lenv* e, lval* a) { return builtin_pdata(a, PDATA_FILTER, "pfilter"); }
+lval* builtin_preduce(lenv* e, lval* a) { return builtin_pdata(a, PDATA_REDUCE, "preduce"); }
+
+/* Deepest nesting of evaluation, past it evaluation stops with an error */
+long eval_max_depth = 100000;
+
+/* Evaluations nested on the C stack of the running thread, by builtins
+   calling functions and evaluating code. Each takes C stack, so another
+   is refused past eval_max_depth or once the stack is nearly used up.
+   "stack_floor" is the lowest address of the stack, NULL when unknown */
+_Thread_local long nest_depth = 0;
+_Thread_local char* stack_floor = NULL;
+
+#define STACK_MARGIN (32 * 1024)
+
+void stack_init(void) {
+    pthread_attr_t attr;
+    void* addr;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) { return; }
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0) { stack_floor = addr; }
+    pthread_attr_destroy(&attr);
+}
+
+/* Start a nested evaluation, NULL when it may go ahead and the error
+   when not. One that went ahead ends with nest_leave */
+lval* nest_enter(void) {
+    char here;
+    char* sp = &here;
+    if (nest_depth + 1 >= eval_max_depth || (stack_floor && sp < stack_floor + STACK_MARGIN)) {
+        return lval_err("Maximum evaluation depth exceeded!");
+    }
+    nest_depth++;
+    return NULL;
+}
+
+void nest_leave(void) { nest_depth--; }
+
+typedef struct eval_frame {
+    lval* v;
+    int i;
+
+    /* Values of the children evaluated so far */
+    lval* args;
+    lenv* env;
+
+    /* What "v" belongs to when it isn't part of the frame below */
+    lval* hold;
+    int special;
+
+    /* Children being evaluated on the pool, or NULL */
+    ptask** tasks;
+} eval_frame;
+
+/* Frame for evaluating "v", with room for the values of all its children */
+eval_frame eval_frame_new(lval* v, lenv* env, lval* hold) {
+    eval_frame f = { v, 0, lval_sexpr(), env, hold, lval_special(v), NULL };
+    f.args->cell = cells_resize(NULL, v->count);
+    if (env) { ref_inc(&env->refs); }
+    return f;
+}
+
+/* Go on to evaluate "v" in place of the frame's expression */
+void eval_frame_enter(eval_frame* f, lval* v) {
+    lval_del(f->args);
+    f->args = lval_sexpr();
+    f->args->cell = cells_resize(NULL, v->count);
+    f->v = v;
+    f->i = 0;
+    f->special = lval_special(v);
+}
+
+void eval_frame_push(eval_frame* f, lval* x) {
+    f->args->cell[f->args->count++] = x;
+}
+
+void eval_frame_free(eval_frame* f) {
+    if (f->tasks) {
+        for (int i = 0; i < f->v->count; i++) {
+            lval* r = f->tasks[i] ? par_join(f->tasks[i]) : NULL;
+            if (r) { lval_del(r); }
+        }
+        free(f->tasks);
+    }
+    if (f->args) { lval_del(f->args); }
+    lenv_release(f->env);
+    if (f->hold) { lval_del(f->hold); }
+}
+
+/* Evaluate in frame "e" (NULL at top level) with an explicit stack of
+   S-expressions under evaluation rather than recursing, so the nesting
+   depth is bounded only by eval_max_depth. Expressions are only read, the
+   values of their children are collected in "args". The first error
+   stops everything at once */
+lval* lval_eval(lenv* e, lval* v) {
+    if (v->type == LVAL_SYM) {
+        lval* x = vval_to_lval(lenv_get(e, v));
+        lval_del(v);
+        return x;
+    }
+
+    /* All other lval types remain the same */
+    if (v->type != LVAL_SEXPR) { return v; }
+
+    return lval_eval_code(e, v, v);
+}
+
+/* Evaluate S-expression "v" in frame "e" without consuming it. "hold" is
+   what keeps "v" alive, released once it is done with, or NULL when the
+   caller keeps it */
+lval* lval_eval_code(lenv* e, lval* v, lval* hold) {
+    int depth = 0;
+    int cap = 16;
+    eval_frame* stack = malloc(sizeof(eval_frame) * cap);
+    stack[0] = eval_frame_new(v, e, hold);
+    lval* r;
+
+    while (1) {
+        eval_frame* f = &stack[depth];
+        if (f->i == 0 && --fuel_left < 0 && (r = fuel_out())) { goto unwind; }
+
+        /* A lambda written out is closed over the frame */
+        if (f->i == 0 && lval_form(f->v) == FORM_LAMBDA && f->v->cell[0]->depth < 0) {
+            r = lval_closure(f->v, f->env);
+            goto pop;
+        }
+
+        /* Special forms look at each value as it comes. A branch taken is
+           evaluated in place of the form */
+        if (f->special && f->i == 0) {
+            r = lval_special_start(f->v, f->special);
+            if (r) { goto pop; }
+            f->i = 1;
+        } else if (f->special && f->args->count) {
+            lval* x = f->args->cell[--f->args->count];
+            int truthy = lval_truthy(x);
+            if (f->special != SPECIAL_IF) {
+                if (f->i == f->v->count || truthy == (f->special == SPECIAL_OR)) {
+                    r = x;
+                    goto pop;
+                }
+                lval_del(x);
+            } else {
+                lval_del(x);
+                lval* branch = truthy ? f->v->cell[2] : f->v->count == 4 ? f->v->cell[3] : NULL;
+                if (branch && branch->type == LVAL_SEXPR) {
+                    eval_frame_enter(f, branch);
+                    continue;
+                }
+                if (!branch) {
+                    r = lval_sexpr();
+                } else if (branch->type == LVAL_SYM) {
+                    r = vval_to_lval(lenv_get(f->env, branch));
+                } else {
+                    r = lval_copy(branch);
+                }
+                goto pop;
+            }
+        }
+
+        /* Big children go to the pool */
+        if (par_enabled && !in_task && f->i == 0 && !f->special) { f->tasks = par_split(f->v, f->env); }
+
+        /* Evaluate Children, S-expressions get a frame of their own */
+        if (f->i < f->v->count) {
+            lval* x = f->v->cell[f->i++];
+
+            /* While tasks are under way the others are evaluated like a
+               task, or in order once every task has finished */
+            if (f->tasks) {
+                ptask** t = &f->tasks[f->i - 1];
+                r = *t ? par_join(*t) : x->type == LVAL_SEXPR ? par_eval(f->env, x, 0) : NULL;
+                *t = NULL;
+                if (r && r->type == LVAL_ERR) { goto unwind; }
+                if (r) {
+                    eval_frame_push(f, r);
+                    continue;
+                }
+                if (x->type == LVAL_SEXPR) { par_quiesce(); }
+            }
+
+            if (x->type != LVAL_SEXPR) {
+                r = x->type == LVAL_SYM ? vval_to_lval(lenv_get(f->env, x)) : lval_copy(x);
+                if (r->type == LVAL_ERR) { goto unwind; }
+                eval_frame_push(f, r);
+                continue;
+            }
+
+            if (depth + 1 >= eval_max_depth) {
+                r = lval_err("Maximum evaluation depth exceeded!");
+                goto unwind;
+            }
+            if (++depth == cap) {
+                cap *= 2;
+                stack = realloc(stack, sizeof(eval_frame) * cap);
+            }
+            stack[depth] = eval_frame_new(x, stack[depth-1].env, NULL);
+            continue;
+        }
+
+        lval* tail = NULL;
+        lenv* tail_env = NULL;
+        lval* tail_hold = NULL;
+        r = lval_eval_sexpr(f->env, f->args, &tail, &tail_env, &tail_hold);
+        f->args = NULL;
+
+        /* Tail evaluation reuses the frame */
+        if (tail) {
+            eval_frame_free(f);
+            *f = eval_frame_new(tail, tail_env, tail_hold);
+            lenv_release(tail_env);
+            continue;
+        }
+
+pop:
+        eval_frame_free(f);
+        if (depth == 0) { break; }
+        depth--;
+        if (r->type == LVAL_ERR) { goto unwind; }
+        eval_frame_push(&stack[depth], r);
+        continue;
+
+unwind:
+        /* An error is the value of everything under way, what is left of
+           it is dropped without being evaluated */
+        for (; depth >= 0; depth--) { eval_frame_free(&stack[depth]); }
+        break;
+    }
+
+    free(stack);
+    return r;
+}
+
+
+/* Optimizer. Before code is evaluated or compiled, calls to pure builtins
+   on literal arguments are replaced by their result and nested arithmetic
+   is flattened into a single call. Q-expressions are data and left alone
+   until something evaluates them */
+
+int optimize = 1;
+
+/* Print code as rewritten by the optimizer */
+int show_opt = 0;
+
+/* Is "f" the name of a pure builtin, not hidden by a local variable */
+int is_pure_builtin(lval* f) {
+    if (f->type != LVAL_SYM || f->depth >= 0) { return 0; }
+    char* sym = f->sym;
+    return arith_sym(sym) || cmp_kind(sym) >= 0
+        || strcmp(sym, "list") == 0 || strcmp(sym, "head") == 0
+        || strcmp(sym, "tail") == 0 || strcmp(sym, "join") == 0;
+}
+
+/* Is "v" a call to "op" with at least "min" cells, operator included */
+int lval_is_call(lval* v, char* op, int min) {
+    return v->type == LVAL_SEXPR && v->count >= min && v->cell[0]->type == LVAL_SYM
+        && v->cell[0]->depth < 0 && strcmp(v->cell[0]->sym, op) == 0;
+}
+
+lval* lval_insert(lval* v, lval* x, int i) {
+    lval_add(v, x);
+    memmove(&v->cell[i+1], &v->cell[i], sizeof(lval*) * (v->count-i-1));
+    v->cell[i] = x;
+    return v;
+}
+
+/* Are the arguments of call "v" number literals, but for the one at "at" */
+int lval_numbers_but(lval* v, int at) {
+    for (int i = 1; i < v->count; i++) {
+        if (i != at && v->cell[i]->type != LVAL_NUM) { return 0; }
+    }
+    return 1;
+}
+
+/* Splice nested calls to the same operator into "v" where that keeps the
+   exact order of operations, which matters for doubles. A nested first
+   argument always can: (- (- a b) c) is (- a b c). With + and * a nested
+   second argument can too, since a + s is s + a: (+ a (+ b c)) is
+   (+ b c a). A call with a single argument is never spliced, into or
+   from: unary - is negation, and on a sequence each operator folds over
+   it.
+   The arguments around the nested call must be number literals. Then
+   nothing else is evaluated before, after or between its arguments, and
+   the first error is the same, as anything failing in the nested call
+   fails as soon in the spliced one */
+void lval_flatten(lval* v) {
+    char* op = v->cell[0]->sym;
+    int commutes = strcmp(op, "+") == 0 || strcmp(op, "*") == 0;
+    if (v->count < 3) { return; }
+
+    while (1) {
+        int at = 0;
+        if (lval_is_call(v->cell[1], op, 3) && lval_numbers_but(v, 1)) {
+            at = 1;
+        } else if (commutes && lval_is_call(v->cell[2], op, 3) && lval_numbers_but(v, 2)) {
+            at = 2;
+        }
+        if (!at) { return; }
+
+        lval* inner = lval_pop(v, at);
+        lval_del(lval_pop(inner, 0));
+        for (int i = 1; inner->count; i++) { lval_insert(v, lval_pop(inner, 0), i); }
+        lval_del(inner);
+    }
+}
+
+/* Run the map and filter stages feeding a fold in one pass: the list at
+   the bottom of the chain is viewed as a sequence, so each stage hands its
+   values straight on to the next. (fold f z (map g (filter p xs))) becomes
+   (fold f z (map g (filter p (seq xs)))) */
+void lval_fuse(lval* v) {
+    lval* src = v->cell[v->count - 1];
+    if (!lval_is_call(src, "map", 3) && !lval_is_call(src, "filter", 3)) { return; }
+    while (lval_is_call(src->cell[2], "map", 3) || lval_is_call(src->cell[2], "filter", 3)) {
+        src = src->cell[2];
+    }
+    if (lval_is_call(src->cell[2], "seq", 2)) { return; }
+
+    lval* view = lval_add(lval_sexpr(), lval_sym("seq"));
+    src->cell[2] = lval_add(view, src->cell[2]);
+    lval_uncache(src);
+}
+
+/* Rewrite an S-expression whose children are already optimized */
+lval* lval_rewrite(lval* v) {
+    if (lval_special(v)) { return v; }
+
+    if (lval_is_call(v, "fold", 4) || lval_is_call(v, "reduce", 3)) { lval_fuse(v); }
+
+    /* Single Expression */
+    if (v->count == 1) { return lval_take(v, 0); }
+
+    if (v->count < 2 || !is_pure_builtin(v->cell[0])) { return v; }
+    char* op = v->cell[0]->sym;
+
+    if (arith_sym(op)) { lval_flatten(v); }
+
+    /* Fold when every argument is a literal, errors are left to happen
+       when the code runs */
+    for (int i = 1; i < v->count; i++) {
+        int type = v->cell[i]->type;
+        if (type != LVAL_NUM && type != LVAL_QEXPR) { return v; }
+    }
+
+    lval* a = lval_copy(v);
+    lval_del(lval_pop(a, 0));
+    lval* r = global_builtin(op)->builtin(NULL, a);
+    if (r->type == LVAL_ERR) {
+        lval_del(r);
+        return v;
+    }
+    lval_del(v);
+    return r;
+}
+
+/* Optimize bottom up with an explicit stack, each frame's expression is a
+   cell of the frame below it */
+lval* lval_optimize(lval* v) {
+    if (v->type != LVAL_SEXPR) { return v; }
+
+    int depth = 0;
+    int cap = 16;
+    eval_frame* stack = malloc(sizeof(eval_frame) * cap);
+    stack[0].v = v;
+    stack[0].i = 0;
+
+    while (1) {
+        eval_frame* f = &stack[depth];
+
+        if (f->i < f->v->count) {
+            lval* x = f->v->cell[f->i];
+            if (x->type != LVAL_SEXPR) {
+                f->i++;
+                continue;
+            }
+            if (++depth == cap) {
+                cap *= 2;
+                stack = realloc(stack, sizeof(eval_frame) * cap);
+            }
+            stack[depth].v = x;
+            stack[depth].i = 0;
+            continue;
+        }
+
+        v = lval_rewrite(f->v);
+        if (depth == 0) { break; }
+        depth--;
+        stack[depth].v->cell[stack[depth].i++] = v;
+    }
+
+    free(stack);
+    return v;
+}
+
+void lval_show(char* label, lval* v) {
+    fflush(stdout);
+    lbuf b;
+    lbuf_init(&b, STDOUT_FILENO);
+    lbuf_puts(&b, label);
+    lval_write(&b, v, &print_limits);
+    lbuf_putc(&b, '\n');
+    lbuf_free(&b);
+}
+
+/* Rewrite the lets and conds in code "v" as the code they stand for, so
+   evaluating code never has to change it. Those in the bodies of lambdas
+   are rewritten when the lambda is made */
+lval* lval_expand(lval* v) {
+    while (lval_is_sugar(v)) { v = lval_desugar(v); }
+    if (v->type != LVAL_SEXPR) { return v; }
+
+    int top = 0;
+    int cap = 16;
+    lval** stack = malloc(sizeof(lval*) * cap);
+    stack[0] = v;
+
+    while (top >= 0) {
+        lval* x = stack[top--];
+        for (int i = 0; i < x->count; i++) {
+            lval* y = x->cell[i];
+            if (lval_is_sugar(y)) {
+                while (lval_is_sugar(y)) { y = lval_desugar(y); }
+                x->cell[i] = y;
+                lval_uncache(x);
+            }
+            if (y->type != LVAL_SEXPR) { continue; }
+            if (++top == cap) {
+                cap *= 2;
+                stack = realloc(stack, sizeof(lval*) * cap);
+            }
+            stack[top] = y;
+        }
+    }
+
+    free(stack);
+    return v;
+}
+
+/* Prepare code that is about to run: it is expanded, then
+   optimized unless that is turned off */
+lval* lval_opt(lval* v) {
+    v = lval_expand(v);
+    if (!optimize) { return v; }
+    v = lval_optimize(v);
+    if (show_opt) { lval_show("opt> ", v); }
+    return v;
+}
+
+
+/* Bytecode compiler and VM. An expression is compiled once into a chunk
+   which can then be run any number of times without touching the tree */
+
+enum {
+    OP_CONST,    /* k    push a copy of constant k */
+    OP_ADD,      /* n    fold the top n numbers */
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_ADDL,     /* n    the same on longs only, quickened from the above */
+    OP_SUBL,
+    OP_MULL,
+    OP_DIVL,
+    OP_MODL,
+    OP_ADDD,     /* n    the same on doubles only */
+    OP_SUBD,
+    OP_MULD,
+    OP_DIVD,
+    OP_MODD,
+    OP_BUILTIN,  /* k n  call builtin constant k on the top n values */
+    OP_CALL,     /* n    call the first of the top n values on the rest */
+    OP_CALLG,    /* k i n  call global symbol constant k on the top n-1 values,
+                    through inline cache i */
+    OP_BOUND,    /* k i n  fail unless global symbol constant k is bound,
+                    filling inline cache i for its call on n-1 values */
+    OP_EVAL,     /*      evaluate the Q-expression on top of the stack */
+    OP_EVALK,    /* k    evaluate constant Q-expression k */
+    OP_GLOBAL,   /* k    push the value of global symbol constant k */
+    OP_LOCAL,    /* k    push the value of resolved symbol constant k */
+    OP_CLOSURE,  /* k    push lambda constant k closed over the current frame */
+    OP_CMP,      /* k    compare the top two numbers by comparison k */
+    OP_JUMP,     /* t    go on at t */
+    OP_JUMPF,    /* t    pop a value, go on at t when it is false */
+    OP_AND,      /* t    go on at t when the top value is false, else pop it */
+    OP_OR,       /* t    go on at t when the top value is true, else pop it */
+    OP_TSET,     /* t    keep a copy of the top value in temporary t */
+    OP_TGET,     /* t    push a copy of temporary t */
+    OP_RET
+};
+
+/* Runs needing no more stack than this don't allocate one */
+#define VM_SMALL_STACK 32
+
+chunk* chunk_new(void) {
+    chunk* c = malloc(sizeof(chunk));
+    c->code = NULL;
+    c->count = 0;
+    c->cap = 0;
+    c->consts = NULL;
+    c->nconsts = 0;
+    c->caches = NULL;
+    c->ncaches = 0;
+    c->max_stack = 0;
+    c->ntemps = 0;
+    c->refs = 1;
+    c->deopts = 0;
+    c->hot = 0;
+    c->jit = NULL;
+    c->jit_size = 0;
+    c->jit_bails = 0;
+    c->scope = NULL;
+    return c;
+}
+
+void chunk_release(chunk* c) {
+    if (ref_dec(&c->refs) > 0) { return; }
+
+    for (int i = 0; i < c->nconsts; i++) {
+        if (c->consts[i].tag == VV_LVAL) { lval_del(c->consts[i].v); }
+    }
+    free(c->consts);
+    free(c->caches);
+    free(c->code);
+    if (c->jit) { jit_free(c); }
+    lscope_release(c->scope);
+    free(c);
+}
+
+void chunk_emit(chunk* c, int word) {
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 16;
+        c->code = realloc(c->code, sizeof(int) * c->cap);
+    }
+    c->code[c->count++] = word;
+}
+
+/* Track how deep the stack gets while the chunk runs */
+void chunk_stack(chunk* c, int* depth, int n) {
+    *depth += n;
+    if (*depth > c->max_stack) { c->max_stack = *depth; }
+}
+
+int chunk_cache(chunk* c) {
+    c->caches = realloc(c->caches, sizeof(icache) * (c->ncaches + 1));
+    c->caches[c->ncaches].version = 0;
+    return c->ncaches++;
+}
+
+int chunk_const(chunk* c, vval k) {
+    c->consts = realloc(c->consts, sizeof(vval) * (c->nconsts + 1));
+    c->consts[c->nconsts] = k;
+    return c->nconsts++;
+}
+
+int arith_opcode(char* sym) {
+    if (strcmp(sym, "+") == 0) { return OP_ADD; }
+    if (strcmp(sym, "-") == 0) { return OP_SUB; }
+    if (strcmp(sym, "*") == 0) { return OP_MUL; }
+    if (strcmp(sym, "/") == 0) { return OP_DIV; }
+    if (strcmp(sym, "%") == 0) { return OP_MOD; }
+    return -1;
+}
+
+void compile_const(chunk* c, vval k, int* depth) {
+    chunk_emit(c, OP_CONST);
+    chunk_emit(c, chunk_const(c, k));
+    chunk_stack(c, depth, 1);
+}
+
+/* The builtin a call is bound to when it is compiled, or NULL when the
+   function is only known once it runs */
+lval* compile_callee(lval* v) {
+    lval* f = v->cell[0];
+    if (f->type != LVAL_SYM || f->depth >= 0) { return NULL; }
+    return global_builtin(f->sym);
+}
+
+/* Whether the function called is a global only known once it runs */
+int compile_global_call(lval* v) {
+    lval* f = v->cell[0];
+    return f->type == LVAL_SYM && f->depth < 0 && !global_builtin(f->sym);
+}
+
+/* Emit the call for an S-expression whose arguments are on the stack. A
+   global function was checked at "bound", whose constant and cache the
+   call shares */
+void compile_call(chunk* c, lval* v, int bound, int* depth) {
+    lval* fn = compile_callee(v);
+    int n = v->count - 1;
+
+    /* A global function is looked up when called, through a cache. Room is
+       kept for it under the arguments, where the cache may have to put it */
+    if (!fn && compile_global_call(v)) {
+        chunk_emit(c, OP_CALLG);
+        chunk_emit(c, c->code[bound]);
+        chunk_emit(c, c->code[bound + 1]);
+        chunk_emit(c, v->count);
+        chunk_stack(c, depth, 1);
+        chunk_stack(c, depth, -n);
+        return;
+    }
+
+    /* The function was computed and sits under its arguments */
+    if (!fn) {
+        chunk_emit(c, OP_CALL);
+        chunk_emit(c, v->count);
+        chunk_stack(c, depth, -n);
+        return;
+    }
+
+    int op = arith_opcode(v->cell[0]->sym);
+    int cmp = cmp_kind(v->cell[0]->sym);
+    if (op >= 0) {
+        chunk_emit(c, op);
+        chunk_emit(c, n);
+    } else if (cmp >= 0 && n == 2) {
+        chunk_emit(c, OP_CMP);
+        chunk_emit(c, cmp);
+    } else if (n == 1 && fn->builtin == builtin_eval) {
+        chunk_emit(c, OP_EVAL);
+    } else {
+        chunk_emit(c, OP_BUILTIN);
+        chunk_emit(c, chunk_const(c, vval_lval(lval_copy(fn))));
+        chunk_emit(c, n);
+    }
+    chunk_stack(c, depth, -(n - 1));
+}
+
+/* Push a variable, local ones by their address */
+void compile_sym(chunk* c, lval* v, int* depth) {
+    chunk_emit(c, v->depth >= 0 ? OP_LOCAL : OP_GLOBAL);
+    chunk_emit(c, chunk_const(c, vval_lval(lval_copy(v))));
+    chunk_stack(c, depth, 1);
+}
+
+/* Common subexpressions. A call to a pure builtin on literals, local
+   variables or other such calls gives the same value wherever it appears
+   in a chunk, so the chunk computes it once, keeps it in a temporary and
+   copies it for every later use. Globals are left out, any call in
+   between could redefine them */
+
+#define CSE_MAX_DEPTH 32
+
+int lval_eq(lval* x, lval* y) {
+    if (x->type != y->type) { return 0; }
+
+    switch (x->type) {
+        case LVAL_NUM:
+            if (x->num_type != y->num_type) { return 0; }
+            if (x->num_type == LVAL_LONG) { return x->num->long_num == y->num->long_num; }
+            return x->num->double_num == y->num->double_num;
+        case LVAL_ERR: return strcmp(x->err, y->err) == 0;
+
+        /* By name, wherever the symbol was written */
+        case LVAL_SYM: return x->sym == y->sym;
+        case LVAL_FUN:
+            return x->builtin == y->builtin && x->proto == y->proto && x->env == y->env
+                && x->memo == y->memo;
+        case LVAL_SEQ: return x->seq == y->seq;
+        case LVAL_FUTURE: return x->future == y->future;
+        case LVAL_CHAN: return x->chan == y->chan;
+        case LVAL_ACTOR: return x->actor == y->actor;
+        case LVAL_HMAP: return x->hmap == y->hmap;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (x->count != y->count) { return 0; }
+
+            /* Lists hashed already are told apart by their hashes */
+            if (x->hash && y->hash && x->hash != y->hash) { return 0; }
+            for (int i = 0; i < x->count; i++) {
+                if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
+            }
+            return 1;
+    }
+    return 0;
+}
+
+/* Hash of a value by its structure, agreeing with lval_eq. Symbols go by
+   their names, so hashes are the same from run to run. Functions and the
+   other values shared by reference go by their identity. A list keeps
+   the hash of its elements until it is changed */
+unsigned long lval_hash(lval* v) {
+    union Number n;
+    switch (v->type) {
+        case LVAL_NUM:
+            /* 0.0 and -0.0 are equal */
+            n = *v->num;
+            if (v->num_type == LVAL_DOUBLE && n.double_num == 0) { n.double_num = 0; }
+            return hash_mix(v->num_type, hash_ptr((void*)n.long_num));
+        case LVAL_ERR: return hash_mix(LVAL_ERR, hash_str(v->err));
+        case LVAL_SYM: return hash_mix(LVAL_SYM, hash_str(v->sym));
+        case LVAL_FUN:
+            return hash_mix(hash_mix(hash_ptr((void*)v->builtin), hash_ptr(v->proto)),
+                            hash_mix(hash_ptr(v->env), hash_ptr(v->memo)));
+        case LVAL_SEQ: return hash_ptr(v->seq);
+        case LVAL_FUTURE: return hash_ptr(v->future);
+        case LVAL_CHAN: return hash_ptr(v->chan);
+        case LVAL_ACTOR: return hash_ptr(v->actor);
+        case LVAL_HMAP: return hash_ptr(v->hmap);
+    }
+    if (!v->hash) {
+        unsigned long h = v->count;
+        for (int i = 0; i < v->count; i++) { h = hash_mix(h, lval_hash(v->cell[i])); }
+        v->hash = h ? h : 1;
+    }
+    return hash_mix(v->type, v->hash);
+}
+
+/* As lval_eq, and symbols must also be resolved to the same variable
+   for two calls to compute the same value */
+int cse_eq(lval* x, lval* y) {
+    if (x->type != y->type) { return 0; }
+    switch (x->type) {
+        case LVAL_SYM: return x->sym == y->sym && x->depth == y->depth && x->slot == y->slot;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (x->count != y->count) { return 0; }
+            for (int i = 0; i < x->count; i++) {
+                if (!cse_eq(x->cell[i], y->cell[i])) { return 0; }
+            }
+            return 1;
+    }
+    return lval_eq(x, y);
+}
+
+/* Hash of a pure call, 0 for anything else */
+unsigned long cse_hash(lval* v, int depth) {
+    union Number n;
+    switch (v->type) {
+        case LVAL_NUM:
+            n = *v->num;
+            return hash_mix(v->num_type, n.long_num);
+        case LVAL_SYM: return v->depth >= 0 ? hash_mix(hash_ptr(v->sym), v->slot) : 0;
+        case LVAL_ERR:
+        case LVAL_FUN:
+        case LVAL_SEQ:
+        case LVAL_FUTURE:
+        case LVAL_CHAN:
+        case LVAL_ACTOR:
+        case LVAL_HMAP: return 0;
+    }
+
+    if (depth == CSE_MAX_DEPTH) { return 0; }
+    unsigned long h = hash_mix(v->type, v->count);
+    int i = 0;
+    if (v->type == LVAL_SEXPR) {
+        if (v->count < 2 || !is_pure_builtin(v->cell[0])) { return 0; }
+        h = hash_mix(h, hash_ptr(v->cell[0]->sym));
+        i = 1;
+    }
+
+    /* Q-expressions are data, only their contents matter */
+    for (; i < v->count; i++) {
+        lval* x = v->cell[i];
+        if (v->type == LVAL_QEXPR && x->type == LVAL_ERR) {
+            h = hash_mix(h, hash_str(x->err));
+            continue;
+        }
+        if (v->type == LVAL_QEXPR && x->type == LVAL_SYM) {
+            h = hash_mix(h, hash_ptr(x->sym));
+            continue;
+        }
+        if (v->type == LVAL_QEXPR && x->type == LVAL_SEXPR) {
+            h = hash_mix(h, x->count);
+            continue;
+        }
+        unsigned long xh = cse_hash(x, depth + 1);
+        if (!xh) { return 0; }
+        h = hash_mix(h, xh);
+    }
+    return h ? h : 1;
+}
+
+typedef struct cse_entry {
+    lval* v;
+    unsigned long hash;
+    int uses;
+    int temp;
+} cse_entry;
+
+typedef struct cse_table {
+    cse_entry* slots;
+    int cap;
+    int count;
+} cse_table;
+
+cse_entry* cse_find(cse_table* t, lval* v, unsigned long hash) {
+    if (!t->cap) { return NULL; }
+    for (int i = hash & (t->cap - 1); t->slots[i].v; i = (i + 1) & (t->cap - 1)) {
+        cse_entry* e = &t->slots[i];
+        if (e->hash == hash && cse_eq(e->v, v)) { return e; }
+    }
+    return NULL;
+}
+
+void cse_count(cse_table* t, lval* v, unsigned long hash) {
+    cse_entry* e = cse_find(t, v, hash);
+    if (e) {
+        e->uses++;
+        return;
+    }
+
+    /* Keep the table at most half full */
+    if (2 * (t->count + 1) > t->cap) {
+        cse_table grown = { calloc(t->cap ? t->cap * 2 : 16, sizeof(cse_entry)), t->cap ? t->cap * 2 : 16, 0 };
+        for (int i = 0; i < t->cap; i++) {
+            if (!t->slots[i].v) { continue; }
+            cse_count(&grown, t->slots[i].v, t->slots[i].hash);
+            cse_find(&grown, t->slots[i].v, t->slots[i].hash)->uses = t->slots[i].uses;
+        }
+        free(t->slots);
+        *t = grown;
+    }
+
+    int i = hash & (t->cap - 1);
+    while (t->slots[i].v) { i = (i + 1) & (t->cap - 1); }
+    t->slots[i].v = v;
+    t->slots[i].hash = hash;
+    t->slots[i].uses = 1;
+    t->slots[i].temp = -1;
+    t->count++;
+}
+
+/* Count the pure calls in the code of "v" */
+void cse_scan(cse_table* t, lval* v) {
+    int top = 0;
+    int cap = 16;
+    lval** todo = malloc(sizeof(lval*) * cap);
+    todo[0] = v;
+
+    while (top >= 0) {
+        v = todo[top--];
+        if (v->count >= 2) {
+            unsigned long hash = cse_hash(v, 0);
+            if (hash) { cse_count(t, v, hash); }
+        }
+
+        /* Only the first argument of a special form is sure to run */
+        int n = lval_special(v) ? 2 : v->count;
+        for (int i = 0; i < n && i < v->count; i++) {
+            if (v->cell[i]->type != LVAL_SEXPR) { continue; }
+            if (++top == cap) {
+                cap *= 2;
+                todo = realloc(todo, sizeof(lval*) * cap);
+            }
+            todo[top] = v->cell[i];
+        }
+    }
+    free(todo);
+}
+
+/* The entry for "v" if it is worth computing once */
+cse_entry* cse_lookup(cse_table* t, lval* v) {
+    if (!t->count || v->count < 2) { return NULL; }
+    unsigned long hash = cse_hash(v, 0);
+    if (!hash) { return NULL; }
+    cse_entry* e = cse_find(t, v, hash);
+    return e && e->uses > 1 ? e : NULL;
+}
+
+typedef struct compile_frame {
+    lval* v;
+    int i;
+
+    /* Temporary to keep the result in, or -1 */
+    int temp;
+
+    /* For special forms, the arguments done so far and the jumps still to
+       be pointed at their target, chained through their operands */
+    int special;
+    int step;
+    int patch;
+
+    /* Where the operands of the OP_BOUND of a global call are, or 0 */
+    int bound;
+} compile_frame;
+
+void compile_patch(chunk* c, int patch) {
+    while (patch >= 0) {
+        int next = c->code[patch];
+        c->code[patch] = c->count;
+        patch = next;
+    }
+}
+
+/* Emit what goes after argument f->i - 1 of special form f. Code after
+   the first argument only runs conditionally, "lazy" counts how deep in
+   such code the compiler is */
+void compile_special(chunk* c, compile_frame* f, int* depth, int* lazy) {
+    int k = f->i - 1;
+    int last = f->i == f->v->count;
+
+    if (f->special == SPECIAL_IF) {
+        if (k == 1) {
+            chunk_emit(c, OP_JUMPF);
+            chunk_emit(c, -1);
+            f->patch = c->count - 1;
+            chunk_stack(c, depth, -1);
+            (*lazy)++;
+            return;
+        }
+        if (k == 2) {
+            /* The branch taken leaves one value, the other starts without it */
+            chunk_emit(c, OP_JUMP);
+            chunk_emit(c, -1);
+            compile_patch(c, f->patch);
+            f->patch = c->count - 1;
+            chunk_stack(c, depth, -1);
+            if (!last) { return; }
+            compile_const(c, vval_lval(lval_sexpr()), depth);
+        }
+        compile_patch(c, f->patch);
+        (*lazy)--;
+        return;
+    }
+
+    if (!last) {
+        chunk_emit(c, f->special == SPECIAL_AND ? OP_AND : OP_OR);
+        chunk_emit(c, f->patch);
+        f->patch = c->count - 1;
+        chunk_stack(c, depth, -1);
+        if (k == 1) { (*lazy)++; }
+        return;
+    }
+    compile_patch(c, f->patch);
+    if (k > 1) { (*lazy)--; }
+}
+
+/* Compile "v", code written in scope "scope" or top level code when it
+   is NULL. S-expressions waiting on their arguments are kept on an explicit
+   stack so deeply nested code compiles without recursion */
+void compile(chunk* c, lval* v, lscope* scope) {
+    int depth = 0;
+    int top = -1;
+    int cap = 16;
+    compile_frame* stack = malloc(sizeof(compile_frame) * cap);
+    int lazy = 0;
+
+    cse_table cse = { NULL, 0, 0 };
+    if (optimize && v->type == LVAL_SEXPR) { cse_scan(&cse, v); }
+
+    while (1) {
+        int special = lval_special(v);
+        lval* r = special ? lval_special_start(v, special) : NULL;
+
+        if (r) {
+            compile_const(c, vval_from_lval(r), &depth);
+        } else if (special) {
+            /* Arguments one at a time, with jumps in between */
+            if (++top == cap) {
+                cap *= 2;
+                stack = realloc(stack, sizeof(compile_frame) * cap);
+            }
+            stack[top] = (compile_frame){ v, 1, -1, special, 1, -1 };
+        } else if (v->type == LVAL_SEXPR) {
+            /* Single Expression */
+            if (v->count == 1) {
+                v = v->cell[0];
+                continue;
+            }
+
+            lval* fn = v->count ? compile_callee(v) : NULL;
+            cse_entry* e = cse_lookup(&cse, v);
+
+            /* Code that may not run can't be the first to compute a value */
+            if (e && e->temp < 0 && lazy) { e = NULL; }
+
+            if (e && e->temp >= 0) {
+                /* Computed before, reuse it */
+                chunk_emit(c, OP_TGET);
+                chunk_emit(c, e->temp);
+                chunk_stack(c, &depth, 1);
+            } else if (!v->count) {
+                /* Empty Expression */
+                compile_const(c, vval_lval(lval_sexpr()), &depth);
+            } else if (fn && fn->builtin == builtin_eval
+                       && v->count == 2 && v->cell[1]->type == LVAL_QEXPR) {
+                /* Evaluating a literal Q-expression compiles it on first use only */
+                chunk_emit(c, OP_EVALK);
+                chunk_emit(c, chunk_const(c, vval_lval(lval_copy(v->cell[1]))));
+                chunk_stack(c, &depth, 1);
+            } else if (fn && fn->builtin == builtin_lambda && lval_form(v) == FORM_LAMBDA) {
+                /* A lambda written out is made here, once, and closed over
+                   the frame each time the code runs */
+                lval* f = lval_lambda(lval_copy(v->cell[1]), lval_copy(v->cell[2]), scope);
+                chunk_emit(c, OP_CLOSURE);
+                chunk_emit(c, chunk_const(c, vval_lval(f)));
+                chunk_stack(c, &depth, 1);
+            } else {
+                /* Arguments first, a builtin is named by the call */
+                if (++top == cap) {
+                    cap *= 2;
+                    stack = realloc(stack, sizeof(compile_frame) * cap);
+                }
+                stack[top] = (compile_frame){ v, fn || compile_global_call(v) ? 1 : 0, -1, 0, 0, -1 };
+
+                /* A global function must be bound before its arguments run */
+                if (!fn && compile_global_call(v)) {
+                    chunk_emit(c, OP_BOUND);
+                    stack[top].bound = c->count;
+                    chunk_emit(c, chunk_const(c, vval_lval(lval_copy(v->cell[0]))));
+                    chunk_emit(c, chunk_cache(c));
+                    chunk_emit(c, v->count);
+                }
+
+                if (e) {
+                    e->temp = stack[top].temp = c->ntemps++;
+                    if (show_opt) { lval_show("cse> ", v); }
+                }
+            }
+        } else if (v->type == LVAL_NUM) {
+            compile_const(c, vval_from_lval(lval_copy(v)), &depth);
+        } else if (v->type == LVAL_SYM) {
+            compile_sym(c, v, &depth);
+        } else {
+            /* Errors and Q-expressions evaluate to themselves */
+            compile_const(c, vval_lval(lval_copy(v)), &depth);
+        }
+
+        /* Move on to the next argument, emitting calls that are complete */
+        while (top >= 0) {
+            compile_frame* f = &stack[top];
+            if (f->special && f->step < f->i) {
+                f->step = f->i;
+                compile_special(c, f, &depth, &lazy);
+            }
+            if (f->i < f->v->count) { break; }
+
+            if (!f->special) {
+                compile_call(c, f->v, f->bound, &depth);
+                if (f->temp >= 0) {
+                    chunk_emit(c, OP_TSET);
+                    chunk_emit(c, f->temp);
+                }
+            }
+            top--;
+        }
+        if (top < 0) { break; }
+        v = stack[top].v->cell[stack[top].i++];
+    }
+
+    free(stack);
+    free(cse.slots);
+    chunk_emit(c, OP_RET);
+}
+
+chunk* lval_compile(lval* v, lscope* scope) {
+    chunk* c = chunk_new();
+    c->scope = scope;
+    if (scope) { ref_inc(&scope->refs); }
+    compile(c, v, scope);
+    return c;
+}
+
+/* Arithmetic over unboxed numbers, consumes the "n" arguments */
+vval vm_arith(int op, vval* args, int n) {
+    static char* names[] = { "+", "-", "*", "/", "%" };
+
+    /* A single sequence is folded over */
+    if (n == 1 && args[0].tag == VV_LVAL && args[0].v->type == LVAL_SEQ) {
+        return vval_from_lval(lval_reduce(args[0].v, names[op - OP_ADD]));
+    }
+
+    /* Ensure all arguments are numbers */
+    for (int i = 0; i < n; i++) {
+        if (args[i].tag == VV_LVAL) {
+            for (int j = 0; j < n; j++) { vval_del(args[j]); }
+            return vval_err("Cannot operate on non-number!");
+        }
+    }
+
+    vval x = args[0];
+
+    /* If no arguments and sub then perform unary negation */
+    if (op == OP_SUB && n == 1) {
+        if (x.tag == VV_LONG) { x.l = -x.l; } else { x.d = -x.d; }
+    }
+
+    for (int i = 1; i < n; i++) {
+        vval y = args[i];
+        if (x.tag != y.tag) { return vval_err("Different types of operands!"); }
+
+        if (x.tag == VV_LONG) {
+            switch (op) {
+                case OP_ADD: x.l += y.l; break;
+                case OP_SUB: x.l -= y.l; break;
+                case OP_MUL: x.l *= y.l; break;
+                case OP_DIV:
+                    if (y.l == 0) { return vval_err("Division By Zero!"); }
+                    if (div_overflows(x.l, y.l)) { return vval_err("Division Overflow!"); }
+                    x.l /= y.l; break;
+                case OP_MOD:
+                    if (y.l == 0) { return vval_err("Division By Zero!"); }
+                    if (div_overflows(x.l, y.l)) { return vval_err("Division Overflow!"); }
+                    x.l %= y.l; break;
+            }
+        } else {
+            switch (op) {
+                case OP_ADD: x.d += y.d; break;
+                case OP_SUB: x.d -= y.d; break;
+                case OP_MUL: x.d *= y.d; break;
+                case OP_DIV:
+                    if (y.d == 0) { return vval_err("Division By Zero!"); }
+                    x.d /= y.d; break;
+                case OP_MOD:
+                    if (y.d == 0) { return vval_err("Division By Zero!"); }
+                    x.d = fmod(x.d, y.d); break;
+            }
+        }
+    }
+    return x;
+}
+
+/* Arithmetic on "n" longs, for quickened instructions that checked them */
+vval vm_arith_long(int op, vval* a, int n) {
+    long x = a[0].l;
+    switch (op) {
+        case OP_ADD: for (int i = 1; i < n; i++) { x += a[i].l; } break;
+        case OP_SUB:
+            if (n == 1) { x = -x; }
+            for (int i = 1; i < n; i++) { x -= a[i].l; }
+            break;
+        case OP_MUL: for (int i = 1; i < n; i++) { x *= a[i].l; } break;
+        case OP_DIV:
+            for (int i = 1; i < n; i++) {
+                if (a[i].l == 0) { return vval_err("Division By Zero!"); }
+                if (div_overflows(x, a[i].l)) { return vval_err("Division Overflow!"); }
+                x /= a[i].l;
+            }
+            break;
+        case OP_MOD:
+            for (int i = 1; i < n; i++) {
+                if (a[i].l == 0) { return vval_err("Division By Zero!"); }
+                if (div_overflows(x, a[i].l)) { return vval_err("Division Overflow!"); }
+                x %= a[i].l;
+            }
+            break;
+    }
+    return vval_long(x);
+}
+
+/* Arithmetic on "n" doubles */
+vval vm_arith_double(int op, vval* a, int n) {
+    double x = a[0].d;
+    switch (op) {
+        case OP_ADD: for (int i = 1; i < n; i++) { x += a[i].d; } break;
+        case OP_SUB:
+            if (n == 1) { x = -x; }
+            for (int i = 1; i < n; i++) { x -= a[i].d; }
+            break;
+        case OP_MUL: for (int i = 1; i < n; i++) { x *= a[i].d; } break;
+        case OP_DIV:
+            for (int i = 1; i < n; i++) {
+                if (a[i].d == 0) { return vval_err("Division By Zero!"); }
+                x /= a[i].d;
+            }
+            break;
+        case OP_MOD:
+            for (int i = 1; i < n; i++) {
+                if (a[i].d == 0) { return vval_err("Division By Zero!"); }
+                x = fmod(x, a[i].d);
+            }
+            break;
+    }
+    return vval_double(x);
+}
+
+/* Quickening. A generic arithmetic instruction at "at" notes the types of
+   its operands and is rewritten into the long or double only version when
+   they all agree. That version only checks its assumption, and turns
+   itself back into the generic one when it breaks. A chunk turning back
+   too often is left generic */
+#define VM_MAX_DEOPTS 8
+
+void vm_quicken(chunk* c, int* at, vval* args, int n) {
+    if (c->deopts >= VM_MAX_DEOPTS) { return; }
+    int tag = args[0].tag;
+    if (tag == VV_LVAL) { return; }
+    for (int i = 1; i < n; i++) {
+        if (args[i].tag != tag) { return; }
+    }
+    if (!code_claim()) { return; }
+    *at += (tag == VV_LONG ? OP_ADDL : OP_ADDD) - OP_ADD;
+    code_release();
+}
+
+/* The generic arithmetic opcode of a quickened one */
+int vm_generic_op(int op) {
+    if (op >= OP_ADDD && op <= OP_MODD) { return op - OP_ADDD + OP_ADD; }
+    if (op >= OP_ADDL && op <= OP_MODL) { return op - OP_ADDL + OP_ADD; }
+    return op;
+}
+
+/* A new reference to the chunk for a Q-expression evaluated in a frame of
+   "scope", compiled the first time it is evaluated there. While tasks run
+   it is compiled afresh instead of cached */
+chunk* lval_chunk(lval* q, lscope* scope) {
+    int own = code_claim();
+    if (!own && !(q->code && q->code->scope == scope)) {
+        lval* x = lval_copy(q);
+        x->type = LVAL_SEXPR;
+        x = lval_opt(x);
+        chunk* c = lval_compile(x, scope);
+        lval_del(x);
+        return c;
+    }
+    if (q->code && q->code->scope != scope) {
+        chunk_release(q->code);
+        q->code = NULL;
+    }
+    if (!q->code) {
+        lval* x = lval_copy(q);
+        x->type = LVAL_SEXPR;
+        x = lval_opt(x);
+        q->code = lval_compile(x, scope);
+        lval_del(x);
+    }
+    chunk* c = q->code;
+    ref_inc(&c->refs);
+    if (own) { code_release(); }
+    return c;
+}
+
+/* The chunk for a lambda's body, compiled on its first call */
+chunk* lproto_chunk(lproto* p) {
+    chunk* c = __atomic_load_n(&p->code, __ATOMIC_ACQUIRE);
+    if (c) { return c; }
+    if (threaded) { pthread_mutex_lock(&code_lock); }
+    if (!p->code) { __atomic_store_n(&p->code, lval_compile(p->body, p->scope), __ATOMIC_RELEASE); }
+    if (threaded) { pthread_mutex_unlock(&code_lock); }
+    return p->code;
+}
+
+/* Call builtin "f" in frame "e", consumes the "n" arguments. Builtins
+   work on boxed values */
+vval vm_builtin(lenv* e, lval* f, vval* args, int n) {
+    lval* a = lval_sexpr();
+    for (int i = 0; i < n; i++) { lval_add(a, vval_to_lval(args[i])); }
+    return vval_from_lval(builtin_call(f, e, a));
+}
+
+/* Template JIT. A chunk that keeps getting run and does nothing but
+   arithmetic on numbers, variables and globals is translated op by op
+   into x86-64 code in its own executable pages. The native code answers 0
+   with the result, or 1 when it hits something it leaves to the
+   interpreter, and the chunk is then run by the VM as usual. It leaves
+   division by zero or by -1, which overflows for the smallest long, and
+   whatever breaks what it assumed when it was compiled: a variable is
+   guessed to keep the type of number it had then, and a global its value
+   while no global is (re)defined */
+
+/* Runs of a chunk before it is compiled, 0 never compiles */
+long jit_threshold = 1000;
+
+#if defined(__x86_64__) && defined(__linux__)
+
+typedef struct jit_buf {
+    unsigned char* code;
+    int len;
+    int cap;
+
+    /* Offsets of rel32 jumps to the bail out path */
+    int* bails;
+    int nbails;
+} jit_buf;
+
+void jit_bytes(jit_buf* j, const char* bytes, int n) {
+    if (j->len + n > j->cap) {
+        j->cap = j->cap ? j->cap * 2 : 256;
+        if (j->cap < j->len + n) { j->cap = j->len + n; }
+        j->code = realloc(j->code, j->cap);
+    }
+    memcpy(j->code + j->len, bytes, n);
+    j->len += n;
+}
+
+void jit_imm32(jit_buf* j, int x) { jit_bytes(j, (char*)&x, 4); }
+void jit_imm64(jit_buf* j, long x) { jit_bytes(j, (char*)&x, 8); }
+
+/* op with a [rsp + disp32] memory operand */
+void jit_rsp(jit_buf* j, const char* op, int n, int modrm, int disp) {
+    char tail[2] = { (char)modrm, 0x24 };
+    jit_bytes(j, op, n);
+    jit_bytes(j, tail, 2);
+    jit_imm32(j, disp);
+}
+
+/* Jump to the bail out path on the condition of "jcc", the opcode of a
+   jcc rel32 */
+void jit_bail_on(jit_buf* j, const char* jcc) {
+    jit_bytes(j, jcc, 2);
+    j->bails = realloc(j->bails, sizeof(int) * (j->nbails + 1));
+    j->bails[j->nbails++] = j->len;
+    jit_imm32(j, 0);
+}
+
+void jit_bail_if_zero(jit_buf* j) { jit_bail_on(j, "\x0f\x84"); }    /* jz */
+
+/* Push variable "s" of frame "env", in rsi, holding a number of type
+   "tag". The frame must still be the one "s" was resolved for, the same
+   check the VM makes, and the value of that type */
+void jit_local(jit_buf* j, lval* s, int tag) {
+    jit_bytes(j, "\x48\x89\xf0", 3);                           /* mov rax, rsi */
+    for (int d = 0; d < s->depth; d++) {
+        jit_bytes(j, "\x48\x85\xc0", 3);                       /* test rax, rax */
+        jit_bail_if_zero(j);
+        jit_bytes(j, "\x48\x8b\x80", 3);                       /* mov rax, [rax + parent] */
+        jit_imm32(j, offsetof(lenv, parent));
+    }
+    jit_bytes(j, "\x48\x85\xc0", 3);                           /* test rax, rax */
+    jit_bail_if_zero(j);
+    jit_bytes(j, "\x48\x8b\x88", 3);                           /* mov rcx, [rax + scope] */
+    jit_imm32(j, offsetof(lenv, scope));
+    jit_bytes(j, "\x81\xb9", 2);                               /* cmp dword [rcx + count], slot */
+    jit_imm32(j, offsetof(lscope, count));
+    jit_imm32(j, s->slot);
+    jit_bail_on(j, "\x0f\x8e");                                 /* jle */
+    jit_bytes(j, "\x48\x8b\x89", 3);                           /* mov rcx, [rcx + names] */
+    jit_imm32(j, offsetof(lscope, names));
+    jit_bytes(j, "\x48\xba", 2);                               /* mov rdx, name */
+    jit_imm64(j, (long)s->sym);
+    jit_bytes(j, "\x48\x39\x91", 3);                           /* cmp [rcx + 8 * slot], rdx */
+    jit_imm32(j, sizeof(char*) * s->slot);
+    jit_bail_on(j, "\x0f\x85");                                 /* jne */
+
+    int at = offsetof(lenv, slots) + sizeof(vval) * s->slot;
+    jit_bytes(j, "\x81\xb8", 2);                               /* cmp dword [rax + tag], tag */
+    jit_imm32(j, at + offsetof(vval, tag));
+    jit_imm32(j, tag);
+    jit_bail_on(j, "\x0f\x85");                                 /* jne */
+    jit_bytes(j, "\x48\x8b\x80", 3);                           /* mov rax, [rax + value] */
+    jit_imm32(j, at + offsetof(vval, l));
+    jit_bytes(j, "\x50", 1);                                    /* push rax */
+}
+
+/* Push "x", the number a global had at "version" */
+void jit_global(jit_buf* j, lval* x, long version) {
+    jit_bytes(j, "\x48\xb8", 2);                               /* mov rax, &global_version */
+    jit_imm64(j, (long)&global_version);
+    jit_bytes(j, "\x48\xb9", 2);                               /* mov rcx, version */
+    jit_imm64(j, version);
+    jit_bytes(j, "\x48\x39\x08", 3);                           /* cmp [rax], rcx */
+    jit_bail_on(j, "\x0f\x85");                                 /* jne */
+    jit_bytes(j, "\x48\xb8", 2);                               /* mov rax, imm64 */
+    jit_imm64(j, x->num->long_num);                             /* doubles by their bits */
+    jit_bytes(j, "\x50", 1);                                    /* push rax */
+}
+
+/* Fold the top "n" stack slots left to right into rax */
+void jit_arith(jit_buf* j, int op, int tag, int n) {
+    int first = 8 * (n - 1);
+
+    if (tag == VV_LONG) {
+        jit_rsp(j, "\x48\x8b", 2, 0x84, first);                /* mov rax, a0 */
+        if (op == OP_SUB && n == 1) { jit_bytes(j, "\x48\xf7\xd8", 3); }  /* neg rax */
+        for (int i = 1; i < n; i++) {
+            int disp = first - 8 * i;
+            switch (op) {
+                case OP_ADD: jit_rsp(j, "\x48\x03", 2, 0x84, disp); break;
+                case OP_SUB: jit_rsp(j, "\x48\x2b", 2, 0x84, disp); break;
+                case OP_MUL: jit_rsp(j, "\x48\x0f\xaf", 3, 0x84, disp); break;
+                case OP_DIV:
+                case OP_MOD:
+                    jit_rsp(j, "\x48\x8b", 2, 0x8c, disp);     /* mov rcx, ai */
+                    jit_bytes(j, "\x48\x85\xc9", 3);           /* test rcx, rcx */
+                    jit_bail_if_zero(j);
+                    jit_bytes(j, "\x48\x83\xf9\xff", 4);       /* cmp rcx, -1 */
+                    jit_bail_if_zero(j);
+                    jit_bytes(j, "\x48\x99\x48\xf7\xf9", 5);   /* cqo; idiv rcx */
+                    if (op == OP_MOD) { jit_bytes(j, "\x48\x89\xd0", 3); }  /* mov rax, rdx */
+                    break;
+            }
+        }
+    } else {
+        jit_rsp(j, "\xf2\x0f\x10", 3, 0x84, first);            /* movsd xmm0, a0 */
+        for (int i = 1; i < n; i++) {
+            int disp = first - 8 * i;
+            switch (op) {
+                case OP_ADD: jit_rsp(j, "\xf2\x0f\x58", 3, 0x84, disp); break;
+                case OP_SUB: jit_rsp(j, "\xf2\x0f\x5c", 3, 0x84, disp); break;
+                case OP_MUL: jit_rsp(j, "\xf2\x0f\x59", 3, 0x84, disp); break;
+                case OP_DIV:
+                    /* 0.0 and -0.0 are the only doubles zero after a shift */
+                    jit_rsp(j, "\x48\x8b", 2, 0x8c, disp);     /* mov rcx, ai */
+                    jit_bytes(j, "\x48\x01\xc9", 3);           /* add rcx, rcx */
+                    jit_bail_if_zero(j);
+                    jit_rsp(j, "\xf2\x0f\x5e", 3, 0x84, disp);
+                    break;
+            }
+        }
+        jit_bytes(j, "\x66\x48\x0f\x7e\xc0", 5);               /* movq rax, xmm0 */
+        if (op == OP_SUB && n == 1) { jit_bytes(j, "\x48\x0f\xba\xf8\x3f", 5); }  /* btc rax, 63 */
+    }
+
+    /* Drop the operands and push the result */
+    jit_bytes(j, "\x48\x81\xc4", 3);                           /* add rsp, imm32 */
+    jit_imm32(j, 8 * n);
+    jit_bytes(j, "\x50", 1);                                   /* push rax */
+}
+
+/* Translate "c", about to run in frame "env", or return 0 if it does
+   anything but arithmetic on numbers of a single type. Operand types are
+   tracked while translating, taking those of the variables and globals
+   as they are now, so the native code only checks them where it loads
+   them */
+int jit_compile(chunk* c, lenv* env) {
+    jit_buf j = { NULL, 0, 0, NULL, 0 };
+    int* types = malloc(sizeof(int) * (c->max_stack + 1));
+    int depth = 0;
+    int ok = 0;
+    int tag = VV_LONG;
+
+    /* push rbp; mov rbp, rsp; push r12; mov r12, rdi */
+    jit_bytes(&j, "\x55\x48\x89\xe5\x41\x54\x49\x89\xfc", 9);
+
+    for (int* ip = c->code; ip < c->code + c->count; ) {
+        int op = vm_generic_op(*ip++);
+        if (op == OP_CONST) {
+            vval k = c->consts[*ip++];
+            if (k.tag == VV_LVAL) { goto done; }
+            jit_bytes(&j, "\x48\xb8", 2);                      /* mov rax, imm64 */
+            jit_imm64(&j, k.l);                               /* doubles by their bits */
+            jit_bytes(&j, "\x50", 1);                          /* push rax */
+            types[depth++] = k.tag;
+        } else if (op == OP_LOCAL) {
+            lval* s = c->consts[*ip++].v;
+            lenv* f = env;
+            for (int d = s->depth; f && d > 0; d--) { f = f->parent; }
+            if (!f || s->slot >= f->scope->count || f->scope->names[s->slot] != s->sym) { goto done; }
+            int t = f->slots[s->slot].tag;
+            if (t == VV_LVAL) { goto done; }
+            jit_local(&j, s, t);
+            types[depth++] = t;
+        } else if (op == OP_GLOBAL) {
+            long version = __atomic_load_n(&global_version, __ATOMIC_ACQUIRE);
+            lval* x = global_get(c->consts[*ip++].v->sym);
+            if (!x || x->type != LVAL_NUM) { goto done; }
+            jit_global(&j, x, version);
+            types[depth++] = x->num_type == LVAL_LONG ? VV_LONG : VV_DOUBLE;
+        } else if (op >= OP_ADD && op <= OP_MOD) {
+            int n = *ip++;
+            depth -= n;
+            for (int i = 0; i < n; i++) {
+                if (types[depth + i] != types[depth]) { goto done; }
+            }
+            if (types[depth] == VV_DOUBLE && op == OP_MOD) { goto done; }
+            jit_arith(&j, op, types[depth], n);
+            depth++;
+        } else if (op == OP_RET) {
+            tag = types[--depth];
+            break;
+        } else {
+            goto done;
+        }
+    }
+
+    /* pop rax; mov [r12+8], rax; mov dword [r12], tag */
+    jit_bytes(&j, "\x58\x49\x89\x44\x24\x08\x41\xc7\x04\x24", 10);
+    jit_imm32(&j, tag);
+    /* lea rsp, [rbp-8]; pop r12; pop rbp; xor eax, eax; ret */
+    jit_bytes(&j, "\x48\x8d\x65\xf8\x41\x5c\x5d\x31\xc0\xc3", 10);
+
+    /* Bail out: unwind the same way and answer 1 */
+    int bail = j.len;
+    jit_bytes(&j, "\x48\x8d\x65\xf8\x41\x5c\x5d\xb8\x01\x00\x00\x00\xc3", 13);
+    for (int i = 0; i < j.nbails; i++) {
+        int rel = bail - (j.bails[i] + 4);
+        memcpy(j.code + j.bails[i], &rel, 4);
+    }
+
+    /* Write the code while the pages are writable, then make them executable */
+    void* mem = mmap(NULL, j.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) { goto done; }
+    memcpy(mem, j.code, j.len);
+    if (mprotect(mem, j.len, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, j.len);
+        goto done;
+    }
+    c->jit = (jit_fn)mem;
+    c->jit_size = j.len;
+    ok = 1;
+
+done:
+    free(types);
+    free(j.code);
+    free(j.bails);
+    return ok;
+}
+
+void jit_free(chunk* c) {
+    munmap((void*)c->jit, c->jit_size);
+}
+
+#else
+
+int jit_compile(chunk* c, lenv* env) { return 0; }
+void jit_free(chunk* c) {}
+
+#endif
+
+/* Count a run of "c" in frame "env", compiling it once it is hot. A
+   chunk is only ever compiled once, or tried once when it cannot be */
+void jit_tick(chunk* c, lenv* env) {
+    if (!jit_threshold || c->hot < 0 || !code_claim()) { return; }
+    if (++c->hot >= jit_threshold) {
+        jit_compile(c, env);
+        c->hot = -1;
+    }
+    code_release();
+}
+
+/* Bail outs after which native code is dropped, as what it assumed
+   keeps failing */
+#define JIT_MAX_BAILS 64
+
+/* Run the native code of "c" in frame "env", answering 1 and the result
+   in "out" or 0 when it bailed out */
+int jit_run(chunk* c, lenv* env, vval* out) {
+    if (c->jit(out, env) == 0) { return 1; }
+    if (!code_claim()) { return 0; }
+    if (++c->jit_bails >= JIT_MAX_BAILS) {
+        jit_free(c);
+        c->jit = NULL;
+    }
+    code_release();
+    return 0;
+}
+
+/* Caller of a chunk started by "eval" or a lambda call, resumed when it
+   returns */
+typedef struct vm_frame {
+    chunk* c;
+    int* ip;
+
+    /* Where its temporaries start on the value stack */
+    int base;
+    lenv* env;
+} vm_frame;
+
+/* Make room for "n" more values above "sp", moving the stack off the C
+   stack once it outgrows "small" */
+vval* vm_reserve(vval** stack, int* cap, vval* small, vval* sp, int n) {
+    int used = sp - *stack;
+    if (used + n <= *cap) { return sp; }
+
+    int grown = *cap * 2;
+    while (grown < used + n) { grown *= 2; }
+    if (*stack == small) {
+        *stack = malloc(sizeof(vval) * grown);
+        memcpy(*stack, small, sizeof(vval) * used);
+    } else {
+        *stack = realloc(*stack, sizeof(vval) * grown);
+    }
+    *cap = grown;
+    return *stack + used;
+}
+
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO
+#endif
+
+/* Whether nothing but jumps lead from "ip" to the return */
+int vm_at_return(chunk* c, int* ip) {
+    while (*ip == OP_JUMP) { ip = c->code + ip[1]; }
+    return *ip == OP_RET;
+}
+
+int vval_truthy(vval x) {
+    if (x.tag == VV_LONG) { return x.l != 0; }
+    if (x.tag == VV_DOUBLE) { return x.d != 0; }
+    return lval_truthy(x.v);
+}
+
+/* Look up the global "sym" called with "n" arguments for cache "ic" */
+void icache_fill(icache* ic, char* sym, int n) {
+    ic->version = __atomic_load_n(&global_version, __ATOMIC_ACQUIRE);
+    ic->f = global_get(sym);
+    ic->code = NULL;
+    if (ic->f && ic->f->type == LVAL_FUN && ic->f->proto && ic->f->proto->scope->count == n) {
+        ic->code = lproto_chunk(ic->f->proto);
+    }
+}
+
+/* Run a chunk in frame "env". Chunks started by "eval" and lambda calls
+   run in the same loop on a frame stack kept on the heap, and one in tail
+   position replaces the running chunk instead of stacking a frame on it */
+vval vm_exec(chunk* c, lenv* env) {
+    if (--fuel_left < 0) {
+        lval* err = fuel_out();
+        if (err) { return vval_lval(err); }
+    }
+
+    vval small[VM_SMALL_STACK];
+    vval* stack = small;
+    int cap = VM_SMALL_STACK;
+    vval* sp = vm_reserve(&stack, &cap, small, stack, c->ntemps + c->max_stack);
+    int base = 0;
+
+    vm_frame* frames = NULL;
+    int nframes = 0;
+    int frames_cap = 0;
+
+    int* ip = c->code;
+    chunk* callee;
+    lenv* callee_env;
+    int ncall;
+    vval r;
+
+    /* Hot arithmetic runs natively */
+    jit_tick(c, env);
+    if (c->jit && jit_run(c, env, &r)) { return r; }
+
+    /* Every running chunk holds a reference to itself and its frame */
+    ref_inc(&c->refs);
+    if (env) { ref_inc(&env->refs); }
+    for (int i = 0; i < c->ntemps; i++) { *sp++ = vval_long(0); }
+
+#ifdef VM_COMPUTED_GOTO
+    static void* dispatch[] = {
+        &&L_OP_CONST, &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV, &&L_OP_MOD,
+        &&L_OP_ADDL, &&L_OP_SUBL, &&L_OP_MULL, &&L_OP_DIVL, &&L_OP_MODL,
+        &&L_OP_ADDD, &&L_OP_SUBD, &&L_OP_MULD, &&L_OP_DIVD, &&L_OP_MODD,
+        &&L_OP_BUILTIN, &&L_OP_CALL, &&L_OP_CALLG, &&L_OP_BOUND,
+        &&L_OP_EVAL, &&L_OP_EVALK,
+        &&L_OP_GLOBAL, &&L_OP_LOCAL, &&L_OP_CLOSURE,
+        &&L_OP_CMP, &&L_OP_JUMP, &&L_OP_JUMPF, &&L_OP_AND, &&L_OP_OR,
+        &&L_OP_TSET, &&L_OP_TGET, &&L_OP_RET
+    };
+#define VM_NEXT() goto *dispatch[*ip++]
+#define VM_CASE(op) L_##op:
+    VM_NEXT();
+#else
+#define VM_NEXT() goto next
+#define VM_CASE(op) case op:
+next:
+    switch (*ip++) {
+#endif
+
+    VM_CASE(OP_CONST) {
+        vval k = c->consts[*ip++];
+        if (k.tag == VV_LVAL) {
+            if (k.v->type == LVAL_ERR) { r = vval_lval(lval_copy(k.v)); goto fail; }
+            k.v = lval_copy(k.v);
+        }
+        *sp++ = k;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_ADD)
+    VM_CASE(OP_SUB)
+    VM_CASE(OP_MUL)
+    VM_CASE(OP_DIV)
+    VM_CASE(OP_MOD) {
+        int op = ip[-1];
+        int n = *ip++;
+        sp -= n;
+        vm_quicken(c, ip - 2, sp, n);
+        r = vm_arith(op, sp, n);
+        if (vval_is_err(r)) { goto fail; }
+        *sp++ = r;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_ADDL)
+    VM_CASE(OP_SUBL)
+    VM_CASE(OP_MULL)
+    VM_CASE(OP_DIVL)
+    VM_CASE(OP_MODL) {
+        int n = *ip;
+        int tags = 0;
+        for (int i = 1; i <= n; i++) { tags |= sp[-i].tag; }
+        if (tags != VV_LONG) { goto deopt; }
+        sp -= n;
+        r = vm_arith_long(ip[-1] - OP_ADDL + OP_ADD, sp, n);
+        ip++;
+        if (vval_is_err(r)) { goto fail; }
+        *sp++ = r;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_ADDD)
+    VM_CASE(OP_SUBD)
+    VM_CASE(OP_MULD)
+    VM_CASE(OP_DIVD)
+    VM_CASE(OP_MODD) {
+        int n = *ip;
+        for (int i = 1; i <= n; i++) {
+            if (sp[-i].tag != VV_DOUBLE) { goto deopt; }
+        }
+        sp -= n;
+        r = vm_arith_double(ip[-1] - OP_ADDD + OP_ADD, sp, n);
+        ip++;
+        if (vval_is_err(r)) { goto fail; }
+        *sp++ = r;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_BUILTIN) {
+        lval* f = c->consts[*ip++].v;
+        int n = *ip++;
+        sp -= n;
+        r = vm_builtin(env, f, sp, n);
+        if (vval_is_err(r)) { goto fail; }
+        *sp++ = r;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_CALL) {
+        ncall = *ip++;
+        sp -= ncall;
+call_value:;
+        int n = ncall;
+        if (sp[0].tag != VV_LVAL || sp[0].v->type != LVAL_FUN) {
+            for (int i = 0; i < n; i++) { vval_del(sp[i]); }
+            r = vval_err("S-expression Does not start with function!");
+            goto fail;
+        }
+        lval* f = sp[0].v;
+
+        /* A computed "eval" runs like a literal one */
+        if (n == 2 && f->builtin == builtin_eval) {
+            lval_del(f);
+            sp[0] = sp[1];
+            sp++;
+            goto eval;
+        }
+
+        if (f->builtin) {
+            r = vm_builtin(env, f, sp + 1, n - 1);
+            lval_del(f);
+            if (vval_is_err(r)) { goto fail; }
+            *sp++ = r;
+            VM_NEXT();
+        }
+
+        lproto* p = f->proto;
+        if (n - 1 != p->scope->count) {
+            for (int i = 0; i < n; i++) { vval_del(sp[i]); }
+            r = vval_lval(lval_err("Function passed %i arguments, expected %i!", n - 1, p->scope->count));
+            goto fail;
+        }
+
+        /* Arguments move into the slots of a new frame */
+        callee_env = lenv_new(p->scope, f->env);
+        memcpy(callee_env->slots, sp + 1, sizeof(vval) * (n - 1));
+        callee = lproto_chunk(p);
+        ref_inc(&callee->refs);
+        lval_del(f);
+        goto call;
+    }
+
+    VM_CASE(OP_CALLG) {
+        lval* s = c->consts[*ip++].v;
+        icache* ic = &c->caches[*ip++];
+        icache own;
+        ncall = *ip++;
+        sp -= ncall - 1;
+        if (ic->version != __atomic_load_n(&global_version, __ATOMIC_ACQUIRE)) {
+            /* Tasks look the global up in a cache of their own */
+            if (code_claim()) {
+                icache_fill(ic, s->sym, ncall - 1);
+                code_release();
+            } else {
+                ic = &own;
+                icache_fill(ic, s->sym, ncall - 1);
+            }
+        }
+
+        /* The lambda is known to take these arguments, enter it directly */
+        if (ic->code) {
+            callee_env = lenv_new(ic->f->proto->scope, ic->f->env);
+            memcpy(callee_env->slots, sp, sizeof(vval) * (ncall - 1));
+            callee = ic->code;
+            ref_inc(&callee->refs);
+            goto call;
+        }
+
+        /* Anything else is called with the function under its arguments */
+        if (!ic->f) {
+            for (int i = 0; i < ncall - 1; i++) { vval_del(sp[i]); }
+            r = vval_lval(lval_err("Unbound Symbol '%s'", s->sym));
+            goto fail;
+        }
+        memmove(sp + 1, sp, sizeof(vval) * (ncall - 1));
+        sp[0] = vval_copy_of(ic->f);
+        goto call_value;
+    }
+
+    VM_CASE(OP_BOUND) {
+        lval* s = c->consts[*ip++].v;
+        icache* ic = &c->caches[*ip++];
+        int n = *ip++;
+        if (ic->version == __atomic_load_n(&global_version, __ATOMIC_ACQUIRE) && ic->f) { VM_NEXT(); }
+        if (code_claim()) {
+            icache_fill(ic, s->sym, n - 1);
+            code_release();
+            if (ic->f) { VM_NEXT(); }
+        } else if (global_get(s->sym)) {
+            VM_NEXT();
+        }
+        r = vval_lval(lval_err("Unbound Symbol '%s'", s->sym));
+        goto fail;
+    }
+
+    VM_CASE(OP_EVAL) {
+eval:
+        r = *--sp;
+        if (r.tag != VV_LVAL || r.v->type != LVAL_QEXPR) {
+            vval_del(r);
+            r = vval_err("Function 'eval' passed incorrect type!");
+            goto fail;
+        }
+        callee = lval_chunk(r.v, env ? env->scope : NULL);
+        lval_del(r.v);
+        callee_env = env;
+        if (env) { ref_inc(&env->refs); }
+        goto call;
+    }
+
+    VM_CASE(OP_EVALK) {
+        callee = lval_chunk(c->consts[*ip++].v, env ? env->scope : NULL);
+        callee_env = env;
+        if (env) { ref_inc(&env->refs); }
+        goto call;
+    }
+
+    VM_CASE(OP_GLOBAL) {
+        lval* s = c->consts[*ip++].v;
+        lval* x = global_get(s->sym);
+        if (!x) {
+            r = vval_lval(lval_err("Unbound Symbol '%s'", s->sym));
+            goto fail;
+        }
+        *sp++ = vval_copy_of(x);
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_LOCAL) {
+        lval* s = c->consts[*ip++].v;
+        lenv* f = env;
+        for (int d = s->depth; f && d > 0; d--) { f = f->parent; }
+        if (f && s->slot < f->scope->count && f->scope->names[s->slot] == s->sym) {
+            *sp++ = vval_dup(f->slots[s->slot]);
+            VM_NEXT();
+        }
+
+        /* Not the frame it was resolved for, look it up by name */
+        r = lenv_get(env, s);
+        if (vval_is_err(r)) { goto fail; }
+        *sp++ = r;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_CLOSURE) {
+        *sp++ = vval_lval(lval_close(c->consts[*ip++].v->proto, env));
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_CMP) {
+        int k = *ip++;
+        vval x = sp[-2];
+        vval y = sp[-1];
+        sp -= 2;
+        if ((x.tag == VV_LVAL || y.tag == VV_LVAL) && (k == CMP_EQ || k == CMP_NE)) {
+            lval* a = lval_add(lval_add(lval_sexpr(), vval_to_lval(x)), vval_to_lval(y));
+            r = vval_from_lval(builtin_cmp(a, k == CMP_EQ ? "==" : "!="));
+            if (vval_is_err(r)) { goto fail; }
+            *sp++ = r;
+            VM_NEXT();
+        }
+        if (x.tag == VV_LVAL || y.tag == VV_LVAL) {
+            vval_del(x); vval_del(y);
+            r = vval_err("Cannot operate on non-number!");
+            goto fail;
+        }
+        if (x.tag != y.tag) {
+            r = vval_err("Different types of operands!");
+            goto fail;
+        }
+        int sign = x.tag == VV_LONG ? (x.l > y.l) - (x.l < y.l) : (x.d > y.d) - (x.d < y.d);
+        *sp++ = vval_long(cmp_holds(k, sign));
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_JUMP) {
+        ip = c->code + *ip;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_JUMPF) {
+        vval x = *--sp;
+        int t = vval_truthy(x);
+        vval_del(x);
+        ip = t ? ip + 1 : c->code + *ip;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_AND)
+    VM_CASE(OP_OR) {
+        int t = vval_truthy(sp[-1]);
+        if (t == (ip[-1] == OP_OR)) {
+            ip = c->code + *ip;
+        } else {
+            vval_del(*--sp);
+            ip++;
+        }
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_TSET) {
+        vval* t = &stack[base + *ip++];
+        *t = sp[-1];
+        if (t->tag == VV_LVAL) { t->v = lval_copy(t->v); }
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_TGET) {
+        vval x = stack[base + *ip++];
+        if (x.tag == VV_LVAL) { x.v = lval_copy(x.v); }
+        *sp++ = x;
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_RET) {
+        r = *--sp;
+        while (sp > stack + base) { vval_del(*--sp); }
+        chunk_release(c);
+        lenv_release(env);
+        if (nframes == 0) { goto done; }
+
+        nframes--;
+        c = frames[nframes].c;
+        ip = frames[nframes].ip;
+        base = frames[nframes].base;
+        env = frames[nframes].env;
+        *sp++ = r;
+        VM_NEXT();
+    }
+
+#ifndef VM_COMPUTED_GOTO
+    }
+#endif
+#undef VM_NEXT
+#undef VM_CASE
+
+call:
+    if (--fuel_left < 0) {
+        lval* err = fuel_out();
+        if (err) {
+            chunk_release(callee);
+            lenv_release(callee_env);
+            r = vval_lval(err);
+            goto fail;
+        }
+    }
+    jit_tick(callee, callee_env);
+    if (callee->jit && jit_run(callee, callee_env, &r)) {
+        chunk_release(callee);
+        lenv_release(callee_env);
+        *sp++ = r;
+#ifdef VM_COMPUTED_GOTO
+        goto *dispatch[*ip++];
+#else
+        goto next;
+#endif
+    }
+
+    if (vm_at_return(c, ip)) {
+        /* Tail position, the caller has nothing left to do */
+        while (sp > stack + base) { vval_del(*--sp); }
+        chunk_release(c);
+        lenv_release(env);
+    } else {
+        if (nframes + 1 >= eval_max_depth) {
+            chunk_release(callee);
+            lenv_release(callee_env);
+            r = vval_err("Maximum evaluation depth exceeded!");
+            goto fail;
+        }
+        if (nframes == frames_cap) {
+            frames_cap = frames_cap ? frames_cap * 2 : 16;
+            frames = realloc(frames, sizeof(vm_frame) * frames_cap);
+        }
+        frames[nframes].c = c;
+        frames[nframes].ip = ip;
+        frames[nframes].base = base;
+        frames[nframes].env = env;
+        nframes++;
+    }
+    c = callee;
+    env = callee_env;
+    ip = c->code;
+    sp = vm_reserve(&stack, &cap, small, sp, c->ntemps + c->max_stack);
+    base = sp - stack;
+    for (int i = 0; i < c->ntemps; i++) { *sp++ = vval_long(0); }
+#ifdef VM_COMPUTED_GOTO
+    goto *dispatch[*ip++];
+#else
+    goto next;
+#endif
+
+deopt:
+    /* A quickened instruction met operands it wasn't made for. Code other
+       threads may be running is left as it is, the generic op done here */
+    if (!code_claim()) {
+        int n = *ip++;
+        sp -= n;
+        r = vm_arith(vm_generic_op(ip[-2]), sp, n);
+        if (vval_is_err(r)) { goto fail; }
+        *sp++ = r;
+#ifdef VM_COMPUTED_GOTO
+        goto *dispatch[*ip++];
+#else
+        goto next;
+#endif
+    }
+    c->deopts++;
+    ip[-1] = vm_generic_op(ip[-1]);
+    ip--;
+    code_release();
+#ifdef VM_COMPUTED_GOTO
+    goto *dispatch[*ip++];
+#else
+    goto next;
+#endif
+
+fail:
+    /* Unwind whatever is left on the stack and every pending caller */
+    while (sp > stack) { vval_del(*--sp); }
+    chunk_release(c);
+    lenv_release(env);
+    while (nframes > 0) {
+        nframes--;
+        chunk_release(frames[nframes].c);
+        lenv_release(frames[nframes].env);
+    }
+done:
+    if (stack != small) { free(stack); }
+    free(frames);
+    return r;
+}
+
+lval* vm_run(chunk* c) {
+    return vval_to_lval(vm_exec(c, NULL));
+}
+
+
+/* Evaluate with the tree walker instead of the bytecode VM */
+int use_tree = 0;
+
+/* Call function "f" on the values in "a", for builtins which take
+   functions. A lambda's body runs on whichever engine is in use */
+lval* lval_apply(lval* f, lval* a) {
+    if (f->builtin) { return builtin_call(f, NULL, a); }
+
+    lproto* p = f->proto;
+    if (a->count != p->scope->count) {
+        lval* err = lval_err("Function passed %i arguments, expected %i!", a->count, p->scope->count);
+        lval_del(a);
+        return err;
+    }
+
+    /* Called from a builtin, the body runs deeper in the C stack */
+    lval* err = nest_enter();
+    if (err) {
+        lval_del(a);
+        return err;
+    }
+
+    lenv* env = lenv_new(p->scope, f->env);
+    for (int i = 0; i < a->count; i++) { env->slots[i] = vval_from_lval(a->cell[i]); }
+    a->count = 0;
+    lval_del(a);
+
+    lval* r;
+    if (!use_tree) {
+        r = vval_to_lval(vm_exec(lproto_chunk(p), env));
+    } else if (p->body->type == LVAL_SEXPR) {
+        r = lval_eval_code(env, p->body, NULL);
+    } else {
+        r = lval_eval(env, lval_copy(p->body));
+    }
+    lenv_release(env);
+    nest_leave();
+    return r;
+}
+
+/* Memoization. (memo f) gives a function calling f through a cache of
+   the values it gave before, keyed by the arguments: a call with the
+   same arguments as an earlier one gets that call's value. (memo f n)
+   keeps at most about "n" bytes of arguments and values, 4MB unless
+   told, dropping the least recently used first. (memo-stats m) gives
+   {hits misses entries bytes}. Only worth it for functions without
+   effects. Errors are not kept */
+#define MEMO_BYTES (4L << 20)
+
+/* About the bytes "v" takes */
+long lval_bytes(lval* v) {
+    long n = sizeof(lval);
+    switch (v->type) {
+        case LVAL_NUM: n += sizeof(union Number); break;
+        case LVAL_ERR: n += strlen(v->err) + 1; break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            n += sizeof(lval*) * v->count;
+            for (int i = 0; i < v->count; i++) { n += lval_bytes(v->cell[i]); }
+            break;
+    }
+    return n;
+}
+
+void mentry_free(mentry* x) {
+    lval_del(x->args);
+    lval_del(x->value);
+    free(x);
+}
+
+void lmemo_release(lmemo* m) {
+    if (ref_dec(&m->refs) != 0) { return; }
+    for (mentry* x = m->newest; x;) {
+        mentry* older = x->older;
+        mentry_free(x);
+        x = older;
+    }
+    free(m->buckets);
+    lval_del(m->fn);
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+}
+
+void memo_unlink(lmemo* m, mentry* x) {
+    if (x->newer) { x->newer->older = x->older; } else { m->newest = x->older; }
+    if (x->older) { x->older->newer = x->newer; } else { m->oldest = x->newer; }
+}
+
+void memo_push(lmemo* m, mentry* x) {
+    x->newer = NULL;
+    x->older = m->newest;
+    if (m->newest) { m->newest->newer = x; } else { m->oldest = x; }
+    m->newest = x;
+}
+
+mentry* memo_find(lmemo* m, lval* a, unsigned long h) {
+    if (!m->nbuckets) { return NULL; }
+    for (mentry* x = m->buckets[h & (m->nbuckets - 1)]; x; x = x->next) {
+        if (x->hash == h && lval_eq(x->args, a)) { return x; }
+    }
+    return NULL;
+}
+
+/* Drop entry "x", the least recently used */
+void memo_evict(lmemo* m, mentry* x) {
+    mentry** p = &m->buckets[x->hash & (m->nbuckets - 1)];
+    while (*p != x) { p = &(*p)->next; }
+    *p = x->next;
+    memo_unlink(m, x);
+    m->count--;
+    m->bytes -= x->bytes;
+    mentry_free(x);
+}
+
+void memo_insert(lmemo* m, mentry* x) {
+    if (m->count >= m->nbuckets) {
+        long n = m->nbuckets ? m->nbuckets * 2 : 64;
+        mentry** b = calloc(n, sizeof(mentry*));
+        for (long i = 0; i < m->nbuckets; i++) {
+            for (mentry* y = m->buckets[i]; y;) {
+                mentry* next = y->next;
+                y->next = b[y->hash & (n - 1)];
+                b[y->hash & (n - 1)] = y;
+                y = next;
+            }
+        }
+        free(m->buckets);
+        m->buckets = b;
+        m->nbuckets = n;
+    }
+    x->next = m->buckets[x->hash & (m->nbuckets - 1)];
+    m->buckets[x->hash & (m->nbuckets - 1)] = x;
+    memo_push(m, x);
+    m->count++;
+    m->bytes += x->bytes;
+    while (m->bytes > m->max_bytes && m->oldest) { memo_evict(m, m->oldest); }
+}
+
+/* Call the memoized function on "a". The lock isn't held while the
+   function runs, which may call back in. Two threads missing at once
+   both compute the value and the first to finish keeps it */
+lval* memo_call(lmemo* m, lval* a) {
+    unsigned long h = lval_hash(a);
+    if (threaded) { pthread_mutex_lock(&m->lock); }
+    mentry* x = memo_find(m, a, h);
+    if (x) {
+        m->hits++;
+        memo_unlink(m, x);
+        memo_push(m, x);
+        lval* r = lval_copy(x->value);
+        if (threaded) { pthread_mutex_unlock(&m->lock); }
+        lval_del(a);
+        return r;
+    }
+    m->misses++;
+    if (threaded) { pthread_mutex_unlock(&m->lock); }
+
+    lval* args = lval_copy(a);
+    lval* r = lval_apply(m->fn, a);
+    if (r->type == LVAL_ERR) {
+        lval_del(args);
+        return r;
+    }
+
+    x = malloc(sizeof(mentry));
+    x->hash = h;
+    x->args = args;
+    x->value = lval_copy(r);
+    x->bytes = sizeof(mentry) + lval_bytes(args) + lval_bytes(r);
+    if (threaded) { pthread_mutex_lock(&m->lock); }
+    if (x->bytes > m->max_bytes || memo_find(m, args, h)) {
+        mentry_free(x);
+    } else {
+        memo_insert(m, x);
+    }
+    if (threaded) { pthread_mutex_unlock(&m->lock); }
+    return r;
+}
+
+lval* builtin_memo(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1 || a->count == 2, "Function 'memo' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_FUN, "Function 'memo' passed incorrect type!");
+    LASSERT(a, a->count == 1 || lval_is_long(a->cell[1]), "Function 'memo' passed incorrect type!");
 
-    lval* x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(x);
+    lmemo* m = calloc(1, sizeof(lmemo));
+    m->refs = 1;
+    m->max_bytes = a->count == 2 ? a->cell[1]->num->long_num : MEMO_BYTES;
+    pthread_mutex_init(&m->lock, NULL);
+    m->fn = lval_pop(a, 0);
+    lval_del(a);
+
+    lval* v = lval_builtin(builtin_memo);
+    v->memo = m;
+    return v;
 }
 
-lval* lval_join(lval* x, lval* y) {
+lval* builtin_memo_stats(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1 && a->cell[0]->type == LVAL_FUN && a->cell[0]->memo,
+            "Function 'memo-stats' passed incorrect type!");
+    lmemo* m = a->cell[0]->memo;
+    if (threaded) { pthread_mutex_lock(&m->lock); }
+    lval* r = lval_qexpr();
+    lval_add(r, lval_long_num(m->hits));
+    lval_add(r, lval_long_num(m->misses));
+    lval_add(r, lval_long_num(m->count));
+    lval_add(r, lval_long_num(m->bytes));
+    if (threaded) { pthread_mutex_unlock(&m->lock); }
+    lval_del(a);
+    return r;
+}
 
-    /* For each cell in 'y' add it to 'x' */
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+/* Hash maps. (hmap {k v ...}) makes a map of the keys and values given.
+   (hset m k v) sets key "k" to "v" and (hdel m k) drops it, both changing
+   "m" in place and giving it back. (hget m k) gives the value of "k",
+   (hget m k d) gives "d" when there is none. (hkeys m) lists the keys.
+   Keys are numbers, symbols and Q-expressions of keys, which stand in
+   for strings and compound keys. A map holding itself is never freed */
+#define HMAP_GROUP 16
+#define HMAP_EMPTY (-128)
+#define HMAP_DELETED (-2)
+
+/* Bit "i" is set where control byte "i" of the group at "p" is "c" */
+unsigned hmap_match(signed char* p, signed char c) {
+#if defined(__SSE2__)
+    __m128i g = _mm_loadu_si128((__m128i*)p);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#else
+    unsigned bits = 0;
+    for (int i = 0; i < HMAP_GROUP; i++) { bits |= (unsigned)(p[i] == c) << i; }
+    return bits;
+#endif
+}
+
+/* Bit "i" is set where slot "i" of the group at "p" is empty or deleted,
+   the control bytes with the top bit set */
+unsigned hmap_match_free(signed char* p) {
+#if defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_loadu_si128((__m128i*)p));
+#else
+    unsigned bits = 0;
+    for (int i = 0; i < HMAP_GROUP; i++) { bits |= (unsigned)(p[i] < 0) << i; }
+    return bits;
+#endif
+}
+
+void lhmap_set_ctrl(lhmap* m, long i, signed char c) {
+    m->ctrl[i] = c;
+    if (i < HMAP_GROUP) { m->ctrl[m->cap + i] = c; }
+}
+
+int hkey_eq(vval x, lval* k) {
+    if (x.tag == VV_LONG) { return k->type == LVAL_NUM && k->num_type == LVAL_LONG && k->num->long_num == x.l; }
+    if (x.tag == VV_DOUBLE) { return k->type == LVAL_NUM && k->num_type == LVAL_DOUBLE && k->num->double_num == x.d; }
+    return lval_eq(x.v, k);
+}
+
+/* Slot holding key "k" with hash "h", -1 when there is none. Groups are
+   probed at growing strides, which visits them all as "cap" is a power
+   of two, and the search stops at a group with an empty slot */
+long lhmap_find(lhmap* m, lval* k, unsigned long h) {
+    if (!m->cap) { return -1; }
+    long mask = m->cap - 1;
+    long pos = (h >> 7) & mask;
+    for (long step = HMAP_GROUP;; step += HMAP_GROUP) {
+        signed char* g = m->ctrl + pos;
+        for (unsigned bits = hmap_match(g, h & 0x7f); bits; bits &= bits - 1) {
+            hslot* s = &m->slots[(pos + __builtin_ctz(bits)) & mask];
+            if (s->hash == h && hkey_eq(s->key, k)) { return s - m->slots; }
+        }
+        if (hmap_match(g, HMAP_EMPTY)) { return -1; }
+        pos = (pos + step) & mask;
     }
+}
 
-    /* Delete the empty 'y' and return 'x' */
-    lval_del(y);
-    return x;
+/* First empty or deleted slot on the probe sequence of hash "h" */
+long lhmap_free_slot(lhmap* m, unsigned long h) {
+    long mask = m->cap - 1;
+    long pos = (h >> 7) & mask;
+    for (long step = HMAP_GROUP;; step += HMAP_GROUP) {
+        unsigned bits = hmap_match_free(m->ctrl + pos);
+        if (bits) { return (pos + __builtin_ctz(bits)) & mask; }
+        pos = (pos + step) & mask;
+    }
 }
 
-lval* builtin_join(lval* a) {
+/* Move the entries to a table of "cap" slots, leaving deleted ones */
+void lhmap_resize(lhmap* m, long cap) {
+    signed char* ctrl = m->ctrl;
+    hslot* slots = m->slots;
+    long old = m->cap;
 
-    for (int i = 0; i < a->count; i++) {
-        LASSERT(a, a->cell[i]->type == LVAL_QEXPR,"Function 'join' passed incorrect type.");
+    m->ctrl = mem_alloc(cap + HMAP_GROUP);
+    memset(m->ctrl, HMAP_EMPTY, cap + HMAP_GROUP);
+    m->slots = mem_alloc(sizeof(hslot) * cap);
+    m->cap = cap;
+    m->deleted = 0;
+    for (long i = 0; i < old; i++) {
+        if (ctrl[i] < 0) { continue; }
+        long j = lhmap_free_slot(m, slots[i].hash);
+        lhmap_set_ctrl(m, j, slots[i].hash & 0x7f);
+        m->slots[j] = slots[i];
+    }
+    if (old) {
+        mem_free(ctrl, old + HMAP_GROUP);
+        mem_free(slots, sizeof(hslot) * old);
     }
+    mem_check();
+}
 
-    lval* x = lval_pop(a, 0);
+/* Set key "k" to "v", taking both */
+void lhmap_put(lhmap* m, lval* k, lval* v) {
+    unsigned long h = lval_hash(k);
+    long i = lhmap_find(m, k, h);
+    if (i >= 0) {
+        lval_del(k);
+        vval_del(m->slots[i].value);
+        m->slots[i].value = vval_from_lval(v);
+        return;
+    }
 
-    while (a->count) {
-        x = lval_join(x, lval_pop(a, 0));
+    /* At most 7 slots in 8 are used or deleted, so that probes end. The
+       table doubles until it is at most half full, or is only cleared of
+       deleted slots when that is enough */
+    if ((m->count + m->deleted + 1) * 8 > m->cap * 7) {
+        long cap = m->cap ? m->cap : HMAP_GROUP;
+        while ((m->count + 1) * 2 > cap) { cap *= 2; }
+        lhmap_resize(m, cap);
+    }
+    i = lhmap_free_slot(m, h);
+    if (m->ctrl[i] == HMAP_DELETED) { m->deleted--; }
+    lhmap_set_ctrl(m, i, h & 0x7f);
+    m->slots[i].hash = h;
+    m->slots[i].key = vval_from_lval(k);
+    m->slots[i].value = vval_from_lval(v);
+    m->count++;
+}
+
+void lhmap_remove(lhmap* m, lval* k) {
+    long i = lhmap_find(m, k, lval_hash(k));
+    if (i < 0) { return; }
+    vval_del(m->slots[i].key);
+    vval_del(m->slots[i].value);
+    lhmap_set_ctrl(m, i, HMAP_DELETED);
+    m->count--;
+    m->deleted++;
+}
+
+void lhmap_release(lhmap* m) {
+    if (ref_dec(&m->refs) != 0) { return; }
+    for (long i = 0; i < m->cap; i++) {
+        if (m->ctrl[i] < 0) { continue; }
+        vval_del(m->slots[i].key);
+        vval_del(m->slots[i].value);
+    }
+    if (m->cap) {
+        mem_free(m->ctrl, m->cap + HMAP_GROUP);
+        mem_free(m->slots, sizeof(hslot) * m->cap);
+    }
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+}
+
+/* Whether "k" can be a key */
+int lhmap_key_valid(lval* k) {
+    switch (k->type) {
+        case LVAL_NUM:
+        case LVAL_SYM: return 1;
+        case LVAL_QEXPR:
+            for (int i = 0; i < k->count; i++) {
+                if (!lhmap_key_valid(k->cell[i])) { return 0; }
+            }
+            return 1;
+    }
+    return 0;
+}
+
+/* As lhmap_key_valid, and a key {a} that passes symbol "a" as a value is
+   turned into the symbol, the key "a" of (hmap {a 1}) */
+int lhmap_key(lval* k) {
+    if (!lhmap_key_valid(k)) { return 0; }
+    if (k->type == LVAL_QEXPR && k->count == 1 && k->cell[0]->type == LVAL_SYM) {
+        char* sym = k->cell[0]->sym;
+        lval_del(k->cell[0]);
+        cells_free(k->cell);
+        lval_uncache(k);
+        k->type = LVAL_SYM;
+        k->count = 0;
+        k->cell = NULL;
+        k->sym = sym;
+        k->depth = -1;
+        k->slot = 0;
+    }
+    return 1;
+}
+
+lval* builtin_hmap(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, "Function 'hmap' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'hmap' passed incorrect type!");
+    lval* q = a->cell[0];
+    LASSERT(a, q->count % 2 == 0, "Function 'hmap' passed a key without a value!");
+    for (int i = 0; i < q->count; i += 2) {
+        LASSERT(a, lhmap_key(q->cell[i]), "Function 'hmap' passed a key that isn't a number, symbol or Q-expression!");
     }
 
+    lhmap* m = calloc(1, sizeof(lhmap));
+    m->refs = 1;
+    pthread_mutex_init(&m->lock, NULL);
+
+    /* The keys and values are taken out of the list as they are */
+    q = lval_take(a, 0);
+    for (int i = 0; i < q->count; i += 2) { lhmap_put(m, q->cell[i], q->cell[i + 1]); }
+    q->count = 0;
+    lval_del(q);
+
+    lval* v = mem_alloc(sizeof(lval));
+    v->type = LVAL_HMAP;
+    v->hmap = m;
+    return v;
+}
+
+lval* builtin_hget(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2 || a->count == 3, "Function 'hget' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_HMAP, "Function 'hget' passed incorrect type!");
+    LASSERT(a, lhmap_key(a->cell[1]), "Function 'hget' passed a key that isn't a number, symbol or Q-expression!");
+
+    lhmap* m = a->cell[0]->hmap;
+    unsigned long h = lval_hash(a->cell[1]);
+    if (threaded) { pthread_mutex_lock(&m->lock); }
+    long i = lhmap_find(m, a->cell[1], h);
+    lval* r = i >= 0 ? vval_to_lval(vval_dup(m->slots[i].value)) : NULL;
+    if (threaded) { pthread_mutex_unlock(&m->lock); }
+
+    if (!r && a->count == 3) { r = lval_pop(a, 2); }
     lval_del(a);
-    return x;
+    return r ? r : lval_err("Function 'hget' found no such key!");
+}
+
+lval* builtin_hset(lenv* e, lval* a) {
+    LASSERT(a, a->count == 3, "Function 'hset' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_HMAP, "Function 'hset' passed incorrect type!");
+    LASSERT(a, lhmap_key(a->cell[1]), "Function 'hset' passed a key that isn't a number, symbol or Q-expression!");
+
+    lval* v = lval_pop(a, 2);
+    lval* k = lval_pop(a, 1);
+    lval* m = lval_take(a, 0);
+    if (threaded) { pthread_mutex_lock(&m->hmap->lock); }
+    lhmap_put(m->hmap, k, v);
+    if (threaded) { pthread_mutex_unlock(&m->hmap->lock); }
+    return m;
+}
+
+lval* builtin_hdel(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2, "Function 'hdel' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_HMAP, "Function 'hdel' passed incorrect type!");
+    LASSERT(a, lhmap_key(a->cell[1]), "Function 'hdel' passed a key that isn't a number, symbol or Q-expression!");
+
+    lhmap* m = a->cell[0]->hmap;
+    if (threaded) { pthread_mutex_lock(&m->lock); }
+    lhmap_remove(m, a->cell[1]);
+    if (threaded) { pthread_mutex_unlock(&m->lock); }
+    return lval_take(a, 0);
 }
 
-lval* builtin(lval* a, char* func) {
-    if (strcmp("list", func) == 0) { return builtin_list(a); }
-    if (strcmp("head", func) == 0) { return builtin_head(a); }
-    if (strcmp("tail", func) == 0) { return builtin_tail(a); }
-    if (strcmp("join", func) == 0) { return builtin_join(a); }
-    if (strcmp("eval", func) == 0) { return builtin_eval(a); }
-    if (strstr("+-/*", func)) { return builtin_op(a, func); }
+lval* builtin_hkeys(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1 && a->cell[0]->type == LVAL_HMAP, "Function 'hkeys' passed incorrect type!");
+
+    lhmap* m = a->cell[0]->hmap;
+    lval* r = lval_qexpr();
+    if (threaded) { pthread_mutex_lock(&m->lock); }
+    r->cell = cells_resize(NULL, m->count);
+    for (long i = 0; i < m->cap; i++) {
+        if (m->ctrl[i] >= 0) { r->cell[r->count++] = vval_to_lval(vval_dup(m->slots[i].key)); }
+    }
+    if (threaded) { pthread_mutex_unlock(&m->lock); }
     lval_del(a);
-    return lval_err("Unknown Function!");
+    return r;
+}
+
+/* Evaluate Q-expression "q" as eval would in frame "e", on whichever
+   engine is in use */
+lval* lval_eval_q(lenv* e, lval* q) {
+    lval* err = nest_enter();
+    if (err) {
+        lval_del(q);
+        return err;
+    }
+    lval* r;
+    if (use_tree) {
+        q->type = LVAL_SEXPR;
+        r = lval_eval(e, q);
+    } else {
+        chunk* c = lval_chunk(q, e ? e->scope : NULL);
+        lval_del(q);
+        r = vval_to_lval(vm_exec(c, e));
+        chunk_release(c);
+    }
+    nest_leave();
+    return r;
 }
 
-lval* lval_eval_sexpr(lval* v) {
+/* (fuel n {expr}) evaluates the Q-expression with at most "n" steps, or
+   what is left of any budget it runs under if that is less. The steps
+   it takes count against that budget too */
+lval* builtin_fuel(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2, "Function 'fuel' passed incorrect number of arguments!");
+    LASSERT(a, lval_is_long(a->cell[0]) && a->cell[1]->type == LVAL_QEXPR,
+            "Function 'fuel' passed incorrect type!");
+    LASSERT(a, a->cell[0]->num->long_num >= 0, "Function 'fuel' passed a negative budget!");
 
-    /* Evaluate Children */
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(v->cell[i]);
+    long outer = fuel_total();
+    long n = a->cell[0]->num->long_num;
+    long budget = n < outer ? n : outer;
+    lval* q = lval_take(a, 1);
+    lval_uncache(q);
+
+    /* Tasks and futures started inside keep to the budget, also when
+       they outlive the call */
+    lfuel* prev = fuel_use(lfuel_new(budget));
+    lval* r = lval_eval_q(e, q);
+    lfuel* f = fuel_use(prev);
+    if (prev) { __atomic_sub_fetch(&prev->left, budget - __atomic_load_n(&f->left, __ATOMIC_RELAXED), __ATOMIC_RELAXED); }
+    lfuel_release(f);
+    return r;
+}
+
+/* (timeout ms {expr}) evaluates the Q-expression, stopping it with an
+   error once "ms" milliseconds have passed, or sooner if it runs under
+   a shorter timeout */
+lval* builtin_timeout(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2, "Function 'timeout' passed incorrect number of arguments!");
+    LASSERT(a, lval_is_long(a->cell[0]) && a->cell[1]->type == LVAL_QEXPR,
+            "Function 'timeout' passed incorrect type!");
+    LASSERT(a, a->cell[0]->num->long_num >= 0, "Function 'timeout' passed a negative time!");
+
+    double outer = fuel_deadline;
+    double deadline = now_ns() + a->cell[0]->num->long_num * 1e6;
+    if (!outer || deadline < outer) { fuel_deadline = deadline; }
+    lval* q = lval_take(a, 1);
+    lval_uncache(q);
+
+    lval* r = lval_eval_q(e, q);
+    fuel_deadline = outer;
+    return r;
+}
+
+/* Futures. (future {expr}) evaluates the Q-expression as eval would, in
+   the frame it is written in, but as a task of the pool, and gives back
+   at once a handle for (await f) to wait on. The task holds a copy of the
+   handle. While any future runs, compiled code is left as it is */
+
+/* Evaluate the future's expression, setting its result */
+void lfuture_eval(lfuture* f) {
+    lval* x = f->code;
+    f->code = NULL;
+    f->result = lval_eval_q(f->e, x);
+    atomic_store(&f->ready, 1);
+}
+
+void future_run(ptask* t) {
+    int was = in_task;
+    in_task = 1;
+    lfuture_eval(t->v->future);
+    in_task = was;
+    lval_del(t->v);
+}
+
+/* A future for Q-expression "q" in frame "e", not yet started */
+lval* lval_future(lval* q, lenv* e, int green) {
+    lfuture* f = malloc(sizeof(lfuture));
+    f->refs = 1;
+    f->code = q;
+    lval_uncache(q);
+    f->e = e;
+    if (e) { ref_inc(&e->refs); }
+    f->result = NULL;
+    atomic_init(&f->ready, 0);
+    f->green = green;
+    f->waiters.head = f->waiters.tail = NULL;
+
+    lval* v = mem_alloc(sizeof(lval));
+    v->type = LVAL_FUTURE;
+    v->future = f;
+    return v;
+}
+
+lval* builtin_future(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, "Function 'future' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'future' passed incorrect type!");
+
+    lval* v = lval_future(lval_take(a, 0), e, 0);
+    pool_ensure();
+    ptask* t = ptask_new(future_run);
+    t->v = lval_copy(v);
+    t->detached = 1;
+    pool_push(t);
+    return v;
+}
+
+/* Green threads. (spawn {expr}) evaluates the Q-expression as eval would
+   on a stack of its own, and gives back a future for it. Green threads
+   all run on the main thread, taking turns: one runs until it waits on a
+   channel or a future, or ends, and then the next ready one goes on
+   where it left off. Those left ready when an input is done run before
+   the next is read. When nothing can run while the main code waits, its
+   wait fails instead of hanging */
+#define GREEN_STACK (256 * 1024)
+
+/* Stacks of ended green threads kept for new ones */
+#define GREEN_SPARE_STACKS 64
+
+/* Context of a suspended green thread. On x86-64 that is its stack
+   pointer, with the callee-saved registers pushed on the stack */
+#if defined(__x86_64__)
+
+typedef struct gctx {
+    void* sp;
+} gctx;
+
+void gctx_switch(gctx* from, gctx* to);
+
+__asm__(
+    ".text\n"
+    ".globl gctx_switch\n"
+    ".type gctx_switch, @function\n"
+    "gctx_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq (%rsi), %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size gctx_switch, .-gctx_switch\n"
+);
+
+/* Start "c" at "fn" on the stack, as if just called, with the registers
+   gctx_switch pops zeroed above the return address */
+void gctx_make(gctx* c, char* stack, size_t size, void (*fn)(void)) {
+    void** top = (void**)((unsigned long)(stack + size) & ~15UL);
+    top[-1] = NULL;
+    top[-2] = (void*)fn;
+    for (int i = 3; i <= 8; i++) { top[-i] = NULL; }
+    c->sp = top - 8;
+}
+
+#else
+
+typedef struct gctx {
+    ucontext_t uc;
+} gctx;
+
+void gctx_switch(gctx* from, gctx* to) { swapcontext(&from->uc, &to->uc); }
+
+void gctx_make(gctx* c, char* stack, size_t size, void (*fn)(void)) {
+    getcontext(&c->uc);
+    c->uc.uc_stack.ss_sp = stack;
+    c->uc.uc_stack.ss_size = size;
+    c->uc.uc_link = NULL;
+    makecontext(&c->uc, fn, 0);
+}
+
+#endif
+
+typedef struct gthread {
+    gctx ctx;
+    char* stack;
+
+    /* Future the thread evaluates, NULL for the main code */
+    lval* future;
+
+    /* Value being handed over by a channel */
+    lval* value;
+
+    /* Queue the thread is in, and the next one in it */
+    struct gqueue* queue;
+    struct gthread* next;
+
+    /* Set when its wait failed because nothing else could run */
+    int stuck;
+
+    /* Its own nesting of evaluations and the bottom of its stack */
+    long depth;
+    char* floor;
+} gthread;
+
+void gqueue_push(gqueue* q, gthread* g) {
+    g->queue = q;
+    g->next = NULL;
+    if (q->tail) { q->tail->next = g; } else { q->head = g; }
+    q->tail = g;
+}
+
+gthread* gqueue_pop(gqueue* q) {
+    gthread* g = q->head;
+    if (!g) { return NULL; }
+    q->head = g->next;
+    if (!q->head) { q->tail = NULL; }
+    g->queue = NULL;
+    return g;
+}
+
+void gqueue_remove(gqueue* q, gthread* g) {
+    gthread* prev = NULL;
+    for (gthread* x = q->head; x; prev = x, x = x->next) {
+        if (x != g) { continue; }
+        if (prev) { prev->next = g->next; } else { q->head = g->next; }
+        if (q->tail == g) { q->tail = prev; }
+        g->queue = NULL;
+        return;
     }
+}
 
-    /* Error Checking */
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+gthread green_main = { 0 };
+gthread* green_current = &green_main;
+gqueue green_ready = { NULL, NULL };
+
+/* The thread that just ended, freed by the next one to run */
+gthread* green_ended = NULL;
+
+char* green_spare[GREEN_SPARE_STACKS];
+int green_nspare = 0;
+
+char* green_stack_new(void) {
+    if (green_nspare > 0) { return green_spare[--green_nspare]; }
+    char* stack = mmap(NULL, GREEN_STACK, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) { return NULL; }
+
+    /* A guard page turns overflowing the stack into a crash */
+    mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+    return stack;
+}
+
+void green_reap(void) {
+    if (!green_ended) { return; }
+    if (green_nspare < GREEN_SPARE_STACKS) {
+        green_spare[green_nspare++] = green_ended->stack;
+    } else {
+        munmap(green_ended->stack, GREEN_STACK);
     }
+    free(green_ended);
+    green_ended = NULL;
+}
 
-    /* Empty Expression */
-    if (v->count == 0) { return v; }
+/* Carry on in "next", which has its own stack to nest evaluations on */
+void green_go(gthread* prev, gthread* next) {
+    green_current = next;
+    prev->depth = nest_depth;
+    nest_depth = next->depth;
+    stack_floor = next->floor;
+    gctx_switch(&prev->ctx, &next->ctx);
+}
 
-    /* Single Expression */
-    if (v->count == 1) { return lval_take(v, 0); }
+void green_switch(gthread* next) {
+    green_go(green_current, next);
+    green_reap();
+}
 
-    /* Ensure First Element is Symbol */
-    lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_SYM) {
-        lval_del(f); lval_del(v);
-        return lval_err("S-expression Does not start with symbol!");
+/* The next thread to run once the current one can't. With none ready
+   the main code is waiting on a channel, and its wait fails */
+gthread* green_next(void) {
+    gthread* next = gqueue_pop(&green_ready);
+    if (next) { return next; }
+    if (green_main.queue) { gqueue_remove(green_main.queue, &green_main); }
+    green_main.stuck = 1;
+    return &green_main;
+}
+
+/* Let the ready threads run, coming back after them. 0 when none is */
+int green_yield(void) {
+    if (!green_ready.head) { return 0; }
+    gqueue_push(&green_ready, green_current);
+    green_switch(gqueue_pop(&green_ready));
+    return 1;
+}
+
+/* Wait in the queue the current thread was put in, until taken out by
+   green_wake. 0 when nothing could run meanwhile */
+int green_block(void) {
+    gthread* g = green_current;
+    if (g == &green_main && !green_ready.head) {
+        gqueue_remove(g->queue, g);
+        return 0;
     }
+    green_switch(green_next());
+    int stuck = g->stuck;
+    g->stuck = 0;
+    return !stuck;
+}
 
-    /* Call builtin with operator */
-    lval* result = builtin(v, f->sym);
-    lval_del(f);
-    return result;
+void green_wake(gthread* g) { gqueue_push(&green_ready, g); }
+
+/* Run ready threads until none is */
+void green_drain(void) {
+    while (green_yield()) {}
 }
 
-lval* lval_eval(lval* v) {
-    /* Evaluate Sexpressions */
-    if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(v); }
-    /* All other lval types remain the same */
+void green_entry(void) {
+    green_reap();
+    gthread* g = green_current;
+    lfuture* f = g->future->future;
+    lfuture_eval(f);
+    for (gthread* w; (w = gqueue_pop(&f->waiters));) { green_wake(w); }
+    lval_del(g->future);
+
+    green_ended = g;
+    green_go(g, green_next());
+}
+
+lval* builtin_spawn(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, "Function 'spawn' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'spawn' passed incorrect type!");
+    LASSERT(a, !in_task, "Function 'spawn' cannot start a green thread from a parallel task!");
+
+    char* stack = green_stack_new();
+    LASSERT(a, stack, "Function 'spawn' could not allocate a stack!");
+
+    lval* v = lval_future(lval_take(a, 0), e, 1);
+    gthread* g = calloc(1, sizeof(gthread));
+    g->stack = stack;
+    g->floor = stack + sysconf(_SC_PAGESIZE);
+    g->future = lval_copy(v);
+    gctx_make(&g->ctx, stack, GREEN_STACK, green_entry);
+    green_wake(g);
+    return v;
+}
+
+void lchan_release(lchan* c) {
+    if (ref_dec(&c->refs) > 0) { return; }
+    for (int i = 0; i < c->count; i++) { lval_del(c->buf[(c->head + i) % c->cap]); }
+    free(c->buf);
+    free(c);
+}
+
+lval* builtin_chan(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1 && lval_is_long(a->cell[0]), "Function 'chan' passed incorrect type!");
+    long cap = a->cell[0]->num->long_num;
+    LASSERT(a, cap >= 0 && cap <= INT_MAX, "Function 'chan' passed a capacity out of range!");
+    lval_del(a);
+
+    lchan* c = calloc(1, sizeof(lchan));
+    c->refs = 1;
+    c->cap = cap;
+    c->buf = malloc(sizeof(lval*) * (cap ? cap : 1));
+
+    lval* v = mem_alloc(sizeof(lval));
+    v->type = LVAL_CHAN;
+    v->chan = c;
+    return v;
+}
+
+lval* builtin_send(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2 && a->cell[0]->type == LVAL_CHAN, "Function 'send' passed incorrect type!");
+    LASSERT(a, !in_task, "Function 'send' cannot be used from a parallel task!");
+
+    lchan* c = a->cell[0]->chan;
+    lval* x = lval_pop(a, 1);
+    gthread* r = gqueue_pop(&c->receivers);
+    if (r) {
+        r->value = x;
+        green_wake(r);
+    } else if (c->count < c->cap) {
+        c->buf[(c->head + c->count++) % c->cap] = x;
+    } else {
+        green_current->value = x;
+        gqueue_push(&c->senders, green_current);
+        if (!green_block()) {
+            lval_del(green_current->value);
+            green_current->value = NULL;
+            lval_del(a);
+            return lval_err("Function 'send' would wait forever!");
+        }
+    }
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* builtin_recv(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1 && a->cell[0]->type == LVAL_CHAN, "Function 'recv' passed incorrect type!");
+    LASSERT(a, !in_task, "Function 'recv' cannot be used from a parallel task!");
+
+    /* A sender waiting on a full channel gets its value in as one comes out */
+    lchan* c = a->cell[0]->chan;
+    lval* x;
+    if (c->count > 0) {
+        x = c->buf[c->head];
+        c->head = (c->head + 1) % c->cap;
+        c->count--;
+        gthread* s = gqueue_pop(&c->senders);
+        if (s) {
+            c->buf[(c->head + c->count++) % c->cap] = s->value;
+            s->value = NULL;
+            green_wake(s);
+        }
+    } else if (c->senders.head) {
+        gthread* s = gqueue_pop(&c->senders);
+        x = s->value;
+        s->value = NULL;
+        green_wake(s);
+    } else {
+        gqueue_push(&c->receivers, green_current);
+        if (!green_block()) {
+            lval_del(a);
+            return lval_err("Function 'recv' would wait forever!");
+        }
+        x = green_current->value;
+        green_current->value = NULL;
+    }
+    lval_del(a);
+    return x;
+}
+
+/* Value of a future, or of an actor's code. Waiting for a task of the
+   pool runs other tasks meanwhile, waiting for a green thread lets the
+   others run */
+lval* builtin_await(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, "Function 'await' passed incorrect number of arguments!");
+    lval* x = a->cell[0];
+    if (x->type == LVAL_ACTOR) { x = x->actor->future; }
+    LASSERT(a, x && x->type == LVAL_FUTURE, "Function 'await' passed incorrect type!");
+
+    lfuture* f = x->future;
+    if (f->green && !atomic_load(&f->ready)) {
+        LASSERT(a, !in_task, "Function 'await' cannot wait for a green thread from a parallel task!");
+        gqueue_push(&f->waiters, green_current);
+        LASSERT(a, green_block(), "Function 'await' would wait forever!");
+    }
+    while (!atomic_load(&f->ready)) { pool_help(); }
+    lval* r = lval_copy(f->result);
+    lval_del(a);
+    return r;
+}
+
+/* Actors. (actor f) calls f with the new actor on a thread of its own,
+   for as long as it runs, and gives back the actor; await gives f's
+   value. (tell a x) puts x in the mailbox of actor a, and (receive a)
+   takes the next message from it, waiting for one. Only the actor itself
+   receives. The main code is an actor too, bound to "main". Like a task,
+   an actor can't define globals, so all it shares with the rest is what
+   it is sent. Messages are moved, the sender keeping no reference */
+lactor* lactor_new(void) {
+    lactor* a = malloc(sizeof(lactor));
+    a->refs = 1;
+    a->head = calloc(1, sizeof(mnode));
+    atomic_init(&a->tail, a->head);
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->wake, NULL);
+    atomic_init(&a->waiting, 0);
+    a->fn = a->future = NULL;
+    a->fuel = lfuel_copy(fuel_pool);
+    a->deadline = fuel_deadline;
+    return a;
+}
+
+/* The next message, or NULL when there is none yet. Only the actor takes
+   messages, so "head" is its own */
+lval* lactor_take(lactor* a) {
+    mnode* next = atomic_load(&a->head->next);
+    if (!next) { return NULL; }
+    free(a->head);
+    a->head = next;
+    lval* v = next->v;
+    next->v = NULL;
+    return v;
+}
+
+void lactor_put(lactor* a, lval* v) {
+    mnode* n = malloc(sizeof(mnode));
+    n->v = v;
+    atomic_init(&n->next, NULL);
+    mnode* prev = atomic_exchange(&a->tail, n);
+    atomic_store(&prev->next, n);
+    if (atomic_load(&a->waiting)) {
+        pthread_mutex_lock(&a->lock);
+        pthread_cond_signal(&a->wake);
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+void lactor_release(lactor* a) {
+    if (ref_dec(&a->refs) > 0) { return; }
+    for (lval* v; (v = lactor_take(a));) { lval_del(v); }
+    free(a->head);
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->wake);
+    if (a->fn) { lval_del(a->fn); }
+    if (a->future) { lval_del(a->future); }
+    lfuel_release(a->fuel);
+    free(a);
+}
+
+lval* lval_actor(lactor* a) {
+    lval* v = mem_alloc(sizeof(lval));
+    v->type = LVAL_ACTOR;
+    v->actor = a;
+    return v;
+}
+
+void* actor_thread(void* arg) {
+    lactor* a = arg;
+    actor_self = a;
+    stack_init();
+    in_task = 1;
+    fuel_use(a->fuel);
+    fuel_deadline = a->deadline;
+    lfuture* f = a->future->future;
+    ref_inc(&a->refs);
+    f->result = lval_apply(a->fn, lval_add(lval_sexpr(), lval_actor(a)));
+    fuel_use(NULL);
+    atomic_store(&f->ready, 1);
+    atomic_fetch_sub(&actors_running, 1);
+    lactor_release(a);
+    return NULL;
+}
+
+lval* builtin_actor(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, "Function 'actor' passed incorrect number of arguments!");
+    LASSERT(a, a->cell[0]->type == LVAL_FUN, "Function 'actor' passed incorrect type!");
+
+    /* Starting the pool makes everything shared ready for other threads */
+    pool_ensure();
+    lactor* r = lactor_new();
+    r->fn = lval_take(a, 0);
+    r->future = lval_future(lval_qexpr(), NULL, 0);
+    r->refs = 2;
+    atomic_fetch_add(&actors_running, 1);
+
+    pthread_t th;
+    if (pthread_create(&th, NULL, actor_thread, r) != 0) {
+        atomic_fetch_sub(&actors_running, 1);
+        lactor_release(r);
+        lactor_release(r);
+        return lval_err("Function 'actor' could not start a thread!");
+    }
+    pthread_detach(th);
+    return lval_actor(r);
+}
+
+lval* builtin_tell(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2 && a->cell[0]->type == LVAL_ACTOR, "Function 'tell' passed incorrect type!");
+    lactor_put(a->cell[0]->actor, lval_pop(a, 1));
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* builtin_receive(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1 && a->cell[0]->type == LVAL_ACTOR, "Function 'receive' passed incorrect type!");
+    lactor* self = a->cell[0]->actor;
+    LASSERT(a, self == actor_self, "Function 'receive' can only take messages of the running actor!");
+    lval_del(a);
+
+    /* Sleep only once the message isn't there after saying so, a sender
+       checks for a sleeper after putting its message in. Wake now and then
+       to see whether the wait should be given up */
+    lval* v = lactor_take(self);
+    if (v) { return v; }
+
+    /* An actor stops counting as running while it waits, for the main
+       code to keep its compiled code to itself meanwhile. It goes on
+       only once any rewrite the main code is making is done */
+    if (in_task) { atomic_fetch_sub(&actors_running, 1); }
+    pthread_mutex_lock(&self->lock);
+    atomic_store(&self->waiting, 1);
+    while (!(v = lactor_take(self)) && !(v = eval_stopped())) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 50000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&self->wake, &self->lock, &ts);
+    }
+    atomic_store(&self->waiting, 0);
+    pthread_mutex_unlock(&self->lock);
+    if (in_task) {
+        atomic_fetch_add(&actors_running, 1);
+        while (atomic_load(&code_claimed) > 0) { sched_yield(); }
+    }
     return v;
 }
 
+/* Run each input this many times and report the time per run */
+long bench_runs = 0;
+
+/* Report the memory values take after each input */
+int mem_stats = 0;
+
+lval* eval_input(mpc_ast_t* t) {
+    lval* x = lval_opt(lval_read(t));
+    fuel_refill();
+    if (use_tree) { return lval_eval(NULL, x); }
+
+    chunk* c = lval_compile(x, NULL);
+    lval_del(x);
+    x = vm_run(c);
+    chunk_release(c);
+    return x;
+}
+
+/* The tree walker consumes its input so it has to run on a fresh copy
+   every time, the VM compiles once and reruns the chunk */
+void bench(mpc_ast_t* t) {
+    lval* x = lval_expand(lval_read(t));
+    if (optimize) { x = lval_optimize(x); }
+    double start = now_ns();
+
+    if (use_tree) {
+        for (long i = 0; i < bench_runs; i++) {
+            fuel_refill();
+            lval_del(lval_eval(NULL, lval_copy(x)));
+        }
+    } else {
+        chunk* c = lval_compile(x, NULL);
+        for (long i = 0; i < bench_runs; i++) {
+            fuel_refill();
+            lval_del(vm_run(c));
+        }
+        chunk_release(c);
+    }
+    lval_del(x);
+
+    fprintf(stderr, "%ld runs, %.1f ns/run (%s)\n", bench_runs,
+            (now_ns() - start) / bench_runs, use_tree ? "tree" : "vm");
+}
+
+void usage(char* prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --max-elems N   print at most N elements of each list\n"
+        "  --max-depth N   print lists nested at most N levels deep\n"
+        "  --max-bytes N   print at most about N bytes of each result\n"
+        "  --no-limits     print results in full\n"
+        "  --stream        write results in small chunks as they are produced\n"
+        "  --eval-depth N  stop evaluations nested deeper than N with an error\n"
+        "  --fuel N        stop each input with an error after N evaluation steps\n"
+        "  --mem-quota N   stop each input with an error once it holds N more megabytes of values\n"
+        "  --mem-stats     report the memory values take after each input\n"
+        "  --jit-threshold N  compile arithmetic to native code after N runs, 0 never\n"
+        "  --no-opt        run code as written, without the optimizer\n"
+        "  --show-opt      print code as rewritten by the optimizer\n"
+        "  --tree          evaluate with the tree walker instead of the bytecode VM\n"
+        "  --parallel      evaluate with the tree walker, big independent parts on a thread pool\n"
+        "  --threads N     run N threads in the pool, default $TLISP_THREADS or one per core, at least 2\n"
+        "  --bench N       run each input N times and report the time per run\n",
+        prog);
+}
+
+/* Parse "--name N" style numeric options, returns 0 when malformed */
+int parse_count(char* s, long* out) {
+    char* end;
+    errno = 0;
+    *out = strtol(s, &end, 10);
+    return errno == 0 && *end == '\0' && end != s && *out >= 0;
+}
+
+int parse_args(int argc, char** argv) {
+
+    /* A terminal gets a readable summary of huge results, anything else
+       (a pipe or a file) gets the full result, in large writes unless
+       --stream asks for it to come as it is produced */
+    if (isatty(STDOUT_FILENO)) {
+        print_limits.max_elems = 1000;
+        print_limits.max_depth = 100;
+        print_limits.max_bytes = 1 << 16;
+    }
+
+    long n;
+    char* threads = getenv("TLISP_THREADS");
+    if (threads && parse_count(threads, &n) && n > 0) { par_threads = n; }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-limits") == 0) {
+            print_limits.max_elems = 0;
+            print_limits.max_depth = 0;
+            print_limits.max_bytes = 0;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            print_stream = 1;
+        } else if (strcmp(argv[i], "--no-opt") == 0) {
+            optimize = 0;
+        } else if (strcmp(argv[i], "--show-opt") == 0) {
+            show_opt = 1;
+        } else if (strcmp(argv[i], "--mem-stats") == 0) {
+            mem_stats = 1;
+        } else if (strcmp(argv[i], "--tree") == 0) {
+            use_tree = 1;
+        } else if (strcmp(argv[i], "--parallel") == 0) {
+            par_enabled = use_tree = 1;
+        } else if (i + 1 < argc && parse_count(argv[i+1], &n) && n > 0
+                   && strcmp(argv[i], "--threads") == 0) {
+            par_threads = n; i++;
+        } else if (i + 1 < argc && parse_count(argv[i+1], &n) && n > 0
+                   && strcmp(argv[i], "--eval-depth") == 0) {
+            eval_max_depth = n; i++;
+        } else if (i + 1 < argc && parse_count(argv[i+1], &n) && n > 0
+                   && strcmp(argv[i], "--fuel") == 0) {
+            fuel_limit = n; i++;
+        } else if (i + 1 < argc && parse_count(argv[i+1], &n) && n > 0 && n <= LONG_MAX >> 20
+                   && strcmp(argv[i], "--mem-quota") == 0) {
+            mem_quota = n << 20; i++;
+        } else if (i + 1 < argc && parse_count(argv[i+1], &n)
+                   && strcmp(argv[i], "--jit-threshold") == 0) {
+            jit_threshold = n; i++;
+        } else if (i + 1 < argc && parse_count(argv[i+1], &n) && n > 0
+                   && strcmp(argv[i], "--bench") == 0) {
+            bench_runs = n; i++;
+        } else if (i + 1 < argc && parse_count(argv[i+1], &n)
+                   && strcmp(argv[i], "--max-elems") == 0) {
+            print_limits.max_elems = n; i++;
+        } else if (i + 1 < argc && parse_count(argv[i+1], &n)
+                   && strcmp(argv[i], "--max-depth") == 0) {
+            print_limits.max_depth = n; i++;
+        } else if (i + 1 < argc && parse_count(argv[i+1], &n)
+                   && strcmp(argv[i], "--max-bytes") == 0) {
+            print_limits.max_bytes = n; i++;
+        } else {
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+void on_interrupt(int sig) { atomic_store(&eval_interrupted, 1); }
 
 int main(int argc, char** argv) {
 
+    if (!parse_args(argc, argv)) { return 1; }
+    stack_init();
+    green_main.floor = stack_floor;
+    lenv_add_builtins();
+    if (par_enabled) { pool_ensure(); }
+
+    /* The main code is an actor like any other */
+    actor_self = lactor_new();
+    ref_inc(&actor_self->refs);
+    global_put(intern("main"), lval_actor(actor_self));
+
     mpc_parser_t* Number = mpc_new("number");
     mpc_parser_t* Symbol = mpc_new("symbol");
     mpc_parser_t* Sexpr  = mpc_new("sexpr");
@@ -454,7 +6629,7 @@ int main(int argc, char** argv) {
 
     mpca_lang(MPCA_LANG_DEFAULT,
         "number : /-?[0-9.]+/ ;"
-        "symbol : \"list\" | \"head\" | \"tail\" | \"join\" | \"eval\" | '+' | '-' | '*' | '/' | '%' ;"
+        "symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+/ ;"
         "sexpr  : '(' <expr>* ')' ;"
         "qexpr  : '{' <expr>* '}' ;"
         "expr   : <number> | <symbol> | <sexpr> | <qexpr> ;"
@@ -463,18 +6638,39 @@ int main(int argc, char** argv) {
     );
 
 
+    /* Ctrl+C stops the evaluation running, not the REPL */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_interrupt;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+
     puts("Tlisp Version 0.0.3");
-    puts("Press Ctrl+c to Exit\n");
+    puts("Press Ctrl+c to interrupt, Ctrl+d to Exit\n");
 
     while (1) {
         char* repl_input = readline("tlisp> ");
+
+        /* End of input, e.g. a script piped in */
+        if (!repl_input) { break; }
         add_history(repl_input);
 
         mpc_result_t mpcResult;
         if (mpc_parse("<stdin>", repl_input, Lispy, &mpcResult)) {
-            lval* x = lval_eval(lval_read(mpcResult.output));
+            atomic_store(&eval_interrupted, 0);
+            mem_start();
+            if (bench_runs) { bench(mpcResult.output); }
+            lval* x = eval_input(mpcResult.output);
             lval_println(x);
             lval_del(x);
+            green_drain();
+            if (mem_stats) {
+                mem_check();
+                fprintf(stderr, "%.1f KB live, %.1f KB at most\n",
+                        __atomic_load_n(&mem_live, __ATOMIC_RELAXED) / 1024.0,
+                        __atomic_load_n(&mem_peak, __ATOMIC_RELAXED) / 1024.0);
+            }
             mpc_ast_delete(mpcResult.output);
         } else {
             /* Otherwise Print the Error */
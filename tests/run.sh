@@ -0,0 +1,22 @@
+#!/bin/sh
+# Feed each tests/*.tl to the REPL, one input per line, on every engine and
+# compare the results with tests/*.out. Prompt lines, which echo the input,
+# and the banner are left out. A tests/*.flags file holds options to run
+# its test with. Usage: tests/run.sh [path to tlisp]
+
+tlisp=${1:-./tlisp}
+dir=$(dirname "$0")
+status=0
+
+for t in "$dir"/*.tl; do
+    extra=
+    if [ -f "${t%.tl}.flags" ]; then extra=$(cat "${t%.tl}.flags"); fi
+    for flags in "" --tree --no-opt; do
+        if ! "$tlisp" $extra $flags < "$t" 2>&1 | sed -e '1,2d' -e '/^tlisp>/d' -e '/^$/d' | diff -u "${t%.tl}.out" -; then
+            echo "FAIL: $t $flags"
+            status=1
+        fi
+    done
+done
+
+exit $status